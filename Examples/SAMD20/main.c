@@ -95,6 +95,63 @@ uint32_t sys_read(uint32_t address, void * ptr, uint32_t length)
 
     return bytes;
 }
+#ifdef UTFS_ENABLE_VECTORED
+// The ranges follow on from each other, so a block shared by two of them
+// is only read and written once
+uint32_t sys_writev(uint32_t address, utfs_iovec_t * iov, uint32_t count)
+{
+    uint8_t datablock[DATASTORE_BLOCK_SIZE];
+    uint32_t blockid=BLOCKID_INVALID;
+    uint32_t blockindex=0;
+    uint8_t * dataptr;
+    uint32_t bytes=0;
+    uint32_t x,n;
+
+    for(x=0;x<count && address<=DATASTORE_MAX_ADDRESS;x++)
+    {
+        dataptr = (uint8_t*)iov[x].ptr;
+        if(!dataptr) break;
+        for(n=0;n<iov[x].length && address<=DATASTORE_MAX_ADDRESS;n++)
+        {
+            // Make sure the current block is loaded
+            if(address/DATASTORE_BLOCK_SIZE != blockid)
+            {
+                if(blockid!=BLOCKID_INVALID){
+                    datastore_write_block(blockid,datablock,sizeof(datablock));
+                }
+                blockid=(address/DATASTORE_BLOCK_SIZE);
+                datastore_read_block(blockid,datablock,sizeof(datablock));
+                blockindex = address%DATASTORE_BLOCK_SIZE;
+            }
+
+            datablock[blockindex] = dataptr[n];
+            address++;
+            blockindex++;
+            bytes++;
+        }
+    }
+
+    if(blockid!=BLOCKID_INVALID){
+        datastore_write_block(blockid,datablock,blockindex);
+    }
+
+    return bytes;
+}
+// Reads cost nothing to repeat, each range is read on its own
+uint32_t sys_readv(uint32_t address, utfs_iovec_t * iov, uint32_t count)
+{
+    uint32_t x,n;
+    uint32_t bytes=0;
+
+    for(x=0;x<count;x++)
+    {
+        n = sys_read(address+bytes,iov[x].ptr,iov[x].length);
+        bytes += n;
+        if(n!=iov[x].length) break;
+    }
+    return bytes;
+}
+#endif
 
 
 // Simple 'terminal' for serial port
@@ -15,9 +15,125 @@
 // ----------------------------------------------------------------------------
 #define UTFS_MAX_FILES      5
 #define UTFS_MAX_FILENAME   11
+#define UTFS_HASH_BUCKETS   8   // Built-in filename hash buckets, a power of 2 >= UTFS_MAX_FILES
+#define UTFS_RESERVE_MAX    32767   // Largest per-file reserve, see utfs_set_reserve()
 //#define UTFS_ENABLE_LOG_VPRINTF
 //#define UTFS_ENABLE_LOG_PRINTF
 
+// V2 layout, a directory at the base address locates any single file
+// with one directory read. V1 volumes are still loaded.
+//#define UTFS_ENABLE_DIRECTORY
+#define UTFS_DIR_CHUNK      4   // Directory entries per read/write (stack use)
+
+// Incremental save, utfs_save() only writes the files that changed since
+// they were last loaded or saved, as long as they have not moved. Changes
+// are found with a hash of the data, or only by utfs_mark_dirty() calls
+// if UTFS_INCREMENTAL_EXPLICIT is also set.
+//#define UTFS_ENABLE_INCREMENTAL
+//#define UTFS_INCREMENTAL_EXPLICIT
+
+// Differential writes, every write is first compared against the medium
+// through a UTFS_DIFF_CHUNK byte stack buffer, and only the byte ranges
+// that differ are passed to sys_write()
+//#define UTFS_ENABLE_DIFF_WRITE
+#define UTFS_DIFF_CHUNK     16
+
+// Vectored I/O, the port also provides sys_writev() and sys_readv() and
+// UTFS hands them runs of adjacent headers and data in one call
+#define UTFS_ENABLE_VECTORED
+#define UTFS_IOV_MAX        8   // Ranges per sys_writev() call, even
+
+// Erase-block aligned layout, every file header starts on an
+// UTFS_ALIGN_SIZE boundary of the medium. The padding is recorded in the
+// header before it, so any build can load the volume, and rewriting one
+// file only touches its own blocks. Set the base address on a boundary.
+//#define UTFS_ENABLE_ALIGN
+#define UTFS_ALIGN_SIZE     256 // Bytes, a power of 2 up to 32768
+
+// Log-structured volume, each save appends new versions of the changed
+// files after the last record and load takes the newest version of each.
+// The UTFS_LOG_SIZE byte region is used as two halves; when the live half
+// fills past UTFS_LOG_COMPACT_AT percent, utfs_compact_step() copies the
+// newest records to the other half a step at a time.
+//#define UTFS_ENABLE_LOG_VOLUME
+#define UTFS_LOG_SIZE       1024    // Bytes, both halves
+#define UTFS_LOG_COMPACT_AT 75      // Percent of a half
+#define UTFS_LOG_STEP       256     // Bytes erased per compaction step
+#define UTFS_LOG_CHUNK      32      // Stack buffer for checks and copies
+
+// Write-back cache of whole erase blocks between UTFS and sys_read() /
+// sys_write(). Each dirty block goes back to the medium with a single
+// sys_write() when a save finishes, covering its dirty pages. Vectored I/O
+// is not used with the cache.
+//#define UTFS_ENABLE_CACHE
+#define UTFS_CACHE_PAGE_SIZE    64  // Bytes, smallest unit written back
+#define UTFS_CACHE_ERASE_SIZE   256 // Bytes, up to 32 pages, cached as a unit
+#define UTFS_CACHE_BLOCKS       4   // Erase blocks held in RAM
+
+// Bytes moved by each call to utfs_load_step() / utfs_save_step()
+#define UTFS_STEP_SIZE      64
+
+// Asynchronous medium access for DMA driven ports. utfs_load_step() and
+// utfs_save_step() start each transfer with sys_read_async() /
+// sys_write_async() and return RES_BUSY while it runs; the port calls
+// utfs_io_done() when it finishes. Blocking calls still use sys_read() and
+// sys_write(). Not for use with the cache, diff writes or a log volume.
+//#define UTFS_ENABLE_ASYNC
+
+// Memory mapped media, the port also provides sys_map(). Files registered
+// with UTFS_MAPPED are not copied on load; their data pointer is set to
+// the bytes on the medium, and they are read only from then on.
+//#define UTFS_ENABLE_MAPPED
+
+// Thread safe volumes, for hosts with POSIX threads. Each volume has a
+// reader/writer lock and each registered file a mutex. Loads, saves and
+// changes to the file list hold the volume exclusively. utfs_load_file()
+// and utfs_save_file() of a file that is already in place only share it
+// and lock the file, so different files are read and written at once.
+// The port is then called from several threads. With the cache or a log
+// volume, every call holds the volume exclusively.
+//#define UTFS_ENABLE_LOCK
+
+// Snapshot reads, utfs_snapshot_read() copies a file as it was last loaded
+// or saved into the caller's buffer, without locks and without touching
+// the registered file. A save running meanwhile is never waited for: the
+// copy is the image from before it or after it, or RES_BUSY while the save
+// is writing over that file. Uses the GCC atomic builtins, not for use
+// with a log volume.
+//#define UTFS_ENABLE_SNAPSHOT
+#define UTFS_SNAPSHOT_TRIES 4   // Reads started again when a save begins or ends meanwhile
+
+// Save requests from interrupts, utfs_save_request() puts a file in a
+// ring and returns without touching the medium or any lock.
+// utfs_service(), from the main loop, saves each requested file once
+// however often it was asked for. One producer only: an interrupt, or
+// callers that can't run at the same time. Uses the GCC atomic builtins.
+//#define UTFS_ENABLE_QUEUE
+#define UTFS_QUEUE_SIZE     8   // Ring slots, one stays empty, up to 255
+
+// Coalesced saves, utfs_save() only marks the volume pending and
+// utfs_service() writes it once no save has been asked for in the quiet
+// interval, or when the deadline after the first request is reached. The
+// port also provides sys_tick(), the time base of both. utfs_save_flush()
+// and utfs_save_step() still write at once and cover a pending save, and
+// utfs_commit() writes a pending save before shutdown.
+//#define UTFS_ENABLE_COALESCE
+#define UTFS_COALESCE_QUIET     100     // Ticks, 0 writes at once
+#define UTFS_COALESCE_DEADLINE  1000    // Ticks, 0 for no deadline
+
+#if defined(UTFS_ENABLE_INCREMENTAL) && !defined(UTFS_INCREMENTAL_EXPLICIT)
+#define UTFS_DATA_HASH
+#endif
+
+#ifdef UTFS_ENABLE_CACHE
+// The cache already gathers writes, vectored calls would go around it
+#undef UTFS_ENABLE_VECTORED
+#endif
+
+#ifdef UTFS_ENABLE_LOCK
+#include <pthread.h>
+#endif
+
 // Types
 // ----------------------------------------------------------------------------
 typedef enum{
@@ -29,36 +145,70 @@ typedef enum{
     RES_FILENAME_EXISTS,
     RES_FILESYSTEM_FULL,
     RES_INVALID_FS,
+    RES_BUSY,
 }utfs_result_e;
 
-typedef struct{
+typedef struct utfs_file_s{
     char filename[UTFS_MAX_FILENAME+1];
     uint16_t signature;
     uint16_t flags;
     uint32_t size;
     uint32_t size_loaded;
+    uint16_t reserve;           // Spare bytes kept after the data to grow into
 #ifdef UTFS_ENABLE_EXT_ATTR
     uint32_t attr[4];
 #endif
     void * data;
+    // Driver use only
+    uint32_t hash;
+    struct utfs_file_s * next;
+    uint32_t offset;            // Data offset from the base address, 0 if unknown
+    uint32_t size_stored;       // Size, signature and flags on the medium
+    uint16_t signature_stored;
+    uint8_t flags_stored;
+    uint8_t state;
+    uint16_t gap_stored;        // Padding after the data on the medium
+    uint32_t registered;        // UTFS_REGISTERED_KEY^address while registered
+    struct utfs_volume_s * volume;  // The volume it was registered with
+#ifdef UTFS_DATA_HASH
+    uint32_t data_hash;         // Hash of the data as last loaded or saved
+#endif
+#ifdef UTFS_ENABLE_LOCK
+    pthread_mutex_t lock;       // Held while the file alone is loaded or saved
+#endif
+#ifdef UTFS_ENABLE_SNAPSHOT
+    uint32_t snap_seq;          // Odd while the file alone is saved
+    uint32_t snap_offset;       // Where utfs_snapshot_read() finds it, 0 if unknown
+    uint32_t snap_size;
+#endif
 }utfs_file_t;
 
 // Flags related to files
 //   UTS_EXT_ATTR (Experimental) - Header has extended attributes
 //   UTS_LOAD_EXPLICIT (Experimental) - Only load the file with a call from utfs_load_file()
 //   UTS_SAVE_EXPLICIT (Experimental) - Only save the file with a call from utfs_save_file() or utfs_save_flush()
+//   UTFS_MAPPED - Load points data at the file on the medium, see UTFS_ENABLE_MAPPED
 typedef enum{
 	UTFS_NOFLAGS			= 0,
 #ifdef UTFS_ENABLE_FLAGS
 #ifdef UTFS_ENABLE_EXT_ATTR
-    UTFS_EXT_ATTR       = 0x0001
+    UTFS_EXT_ATTR       = 0x0001,
 #endif
     UTFS_LOAD_EXPLICIT  = 0x0100,
     UTFS_SAVE_EXPLICIT  = 0x0200,
 #endif
+#ifdef UTFS_ENABLE_MAPPED
+    UTFS_MAPPED         = 0x0400,
+#endif
 }utfs_flags_e;
 
 
+// One range of a vectored transfer, see UTFS_ENABLE_VECTORED
+typedef struct{
+    void * ptr;
+    uint32_t length;
+}utfs_iovec_t;
+
 // Options for managing files.
 //   UTFS_OPT_REPLACE - Replace an entry in the file list, if it already exists
 typedef enum{
@@ -66,6 +216,205 @@ typedef enum{
     UTFS_OPT_REPLACE     = 0x01,
 }utfs_options_e;
 
+// Medium access for a volume, the default volume uses the sys_ functions.
+// The optional calls are only used with their UTFS_ENABLE_ option. The
+// asynchronous ones are given the volume, for the port to hand back to
+// utfs_vol_io_done() when the transfer finishes.
+typedef struct utfs_volume_s utfs_volume_t;
+typedef struct{
+    uint32_t (*write)(uint32_t address, void * ptr, uint32_t length);
+    uint32_t (*read)(uint32_t address, void * ptr, uint32_t length);
+#ifdef UTFS_ENABLE_VECTORED
+    uint32_t (*writev)(uint32_t address, utfs_iovec_t * iov, uint32_t count);
+    uint32_t (*readv)(uint32_t address, utfs_iovec_t * iov, uint32_t count);
+#endif
+#ifdef UTFS_ENABLE_ASYNC
+    bool (*write_async)(utfs_volume_t * v, uint32_t address, void * ptr, uint32_t length);
+    bool (*read_async)(utfs_volume_t * v, uint32_t address, void * ptr, uint32_t length);
+#endif
+#ifdef UTFS_ENABLE_MAPPED
+    void * (*map)(uint32_t address, uint32_t length);
+#endif
+#ifdef UTFS_ENABLE_COALESCE
+    uint32_t (*tick)(void);
+#endif
+}utfs_port_t;
+
+// Volume state, the types below are private to utfs.c
+// ----------------------------------------------------------------------------
+// File header on the medium
+typedef struct{
+    uint16_t identifier;
+    uint8_t version;
+    uint8_t flags;
+    uint16_t signature;
+    uint16_t reserved;      // Bytes of padding between the data and the next header
+    uint32_t size;
+    char filename[12];
+}utfs_header_t;
+
+// Pending writes to the medium, see _batch_write()
+#ifdef UTFS_ENABLE_VECTORED
+#define UTFS_BATCH_HEADERS  (UTFS_IOV_MAX/2)
+typedef struct{
+    uint32_t address;
+    uint32_t length;
+    uint32_t count;
+    utfs_iovec_t iov[UTFS_IOV_MAX];
+}utfs_batch_t;
+#else
+#define UTFS_BATCH_HEADERS  1
+typedef struct{
+    uint32_t count;
+}utfs_batch_t;
+#endif
+
+#ifdef UTFS_ENABLE_LOG_VOLUME
+// Walk of the records in one half of a log
+typedef struct{
+    uint32_t start;
+    uint32_t end;           // Records stop before this
+    uint32_t pos;           // Next record
+    uint32_t last;          // Last record found, 0 for none
+    uint32_t size;          // Its data size and check
+    uint16_t check;
+    bool checking;          // The walk is over, the last record is checked
+    uint32_t done;          // Bytes of its data checked
+    uint32_t hash;
+}utfs_log_scan_t;
+#endif
+
+// Running load or save, see utfs_load_step() and utfs_save_step()
+typedef struct{
+    uint8_t op;             // UTFS_OP_
+    uint8_t phase;          // UTFS_PHASE_
+    bool flush;             // Save everything
+    bool commit;            // Write back the cache at the end
+    bool write_data;        // Save, the current file's data is written
+    bool fetched;           // Load, the next header came in with the data
+    bool valid;             // Load, and it is a header
+    uint16_t gap;           // Save, padding after the current file
+    uint32_t index;         // Files saved, or headers read
+    uint32_t loaded;        // Files loaded
+    uint32_t unresolved;    // Load, registered files not found yet
+    uint32_t unmatched;     // Load, headers that match no registered file
+    uint32_t pos;           // Medium address of the current header or data
+    uint32_t next;          // Load, address of the next header
+    uint32_t done;          // Bytes of the current file's data moved
+    uint32_t size;          // Load, bytes of the current file's data to read
+    utfs_file_t * f;        // File being saved, or loaded (NULL to skip the data)
+    utfs_header_t header;   // Load, or the log record being saved
+    uint32_t h;             // Save, headers used in the batch
+    utfs_header_t headers[UTFS_BATCH_HEADERS];
+    utfs_batch_t batch;
+#ifdef UTFS_ENABLE_DIRECTORY
+    uint32_t dir_entry;     // Save, next directory entry to write
+    uint32_t dir_offset;    // Save, data offset of the file before it
+    bool dir_changed;       // Save, the next chunk of entries is written
+#endif
+#ifdef UTFS_ENABLE_COALESCE
+    bool pending;           // Save, writes a pending utfs_save()
+#endif
+#ifdef UTFS_ENABLE_LOG_VOLUME
+    utfs_log_scan_t scan;   // Walk of the live half
+    utfs_file_t * only;     // Save, the one file to write, NULL for all
+    bool compacted;         // Save, room was made for the current file
+    uint32_t hash;          // Save, of the record's data written so far
+#endif
+#ifdef UTFS_ENABLE_ASYNC
+    bool async;            // Transfers go through sys_read_async() / sys_write_async()
+    uint8_t io;             // UTFS_IO_ transfer running
+    uint32_t io_length;     // Bytes asked of it
+    utfs_file_t * reading;  // Load, file whose data is coming in
+    utfs_header_t ahead;    // Load, the header read ahead
+#endif
+}utfs_op_t;
+
+#ifdef UTFS_ENABLE_CACHE
+// One erase block held in RAM
+typedef struct{
+    uint32_t block;     // Erase block number, address/UTFS_CACHE_ERASE_SIZE
+    uint32_t length;    // Bytes of the block inside the volume, writes stop here
+    uint32_t filled;    // Bytes read from the medium, or written since
+    uint32_t dirty;     // One bit per page that needs writing back
+    bool valid;
+    uint8_t data[UTFS_CACHE_ERASE_SIZE];
+}utfs_cache_line_t;
+#endif
+
+// One volume: its port, registered files and everything UTFS keeps
+// between calls. Set up with utfs_vol_init().
+struct utfs_volume_s{
+    uint32_t live;              // UTFS_LIVE_KEY^address once set up
+    const utfs_port_t * port;
+#if UTFS_MAX_FILES>0
+    utfs_file_t * table[UTFS_MAX_FILES];
+#endif
+    utfs_file_t ** file_list;
+    uint32_t file_capacity;
+    uint32_t file_count;
+    utfs_file_t * hash_table[UTFS_HASH_BUCKETS];
+    utfs_file_t ** hash_list;   // Buckets in use, see utfs_hash_set()
+    uint32_t hash_mask;
+    bool verbose;
+    uint32_t baseaddr;
+    uint32_t size;              // Bytes from the base address, 0 for no limit
+    utfs_op_t op;
+    uint8_t * scratch;          // Caller's buffer for loads, see utfs_scratch_set()
+    uint32_t scratch_size;
+    uint32_t scratch_addr;      // Medium address of the bytes in it
+    uint32_t scratch_len;
+    uint32_t load_unmatched;    // From the last load, see utfs_load_stats()
+    uint32_t load_missing;
+#ifdef UTFS_ENABLE_ASYNC
+    volatile bool io_pending;
+    volatile uint32_t io_length;    // Bytes moved by the last transfer
+#endif
+#ifdef UTFS_ENABLE_DIRECTORY
+    bool dir_checked;
+    bool dir_present;
+    uint32_t dir_count;
+    uint32_t dir_pad;
+#endif
+#ifdef UTFS_ENABLE_LOG_VOLUME
+    bool log_mounted;
+    uint32_t log_half;          // Live half, 0 or 1
+    uint16_t log_epoch;         // Epoch of the live half, 0 if no log
+    uint32_t log_tail;          // Where the next record goes
+    uint8_t log_compact;        // UTFS_COMPACT_ phase
+    uint32_t log_compact_pos;   // Next address to erase or copy to
+    bool log_restarted;         // Compaction started over, nothing saved since
+#endif
+#ifdef UTFS_ENABLE_CACHE
+    utfs_cache_line_t cache[UTFS_CACHE_BLOCKS];
+    uint32_t cache_next;
+#endif
+#ifdef UTFS_ENABLE_LOCK
+    pthread_rwlock_t lock;
+#endif
+#ifdef UTFS_ENABLE_SNAPSHOT
+    uint32_t snap_seq;          // Odd while a save runs
+    uint32_t snap_low;          // Medium range it has written so far
+    uint32_t snap_high;
+#endif
+#ifdef UTFS_ENABLE_QUEUE
+    utfs_file_t * queue[UTFS_QUEUE_SIZE];   // Save requests, NULL for the whole volume
+    uint8_t queue_head;         // Next slot filled, moved by the producer only
+    uint8_t queue_tail;         // Next slot drained, moved by utfs_service() only
+    uint8_t queue_lost;         // Requests that found the ring full
+    uint8_t queue_lost_seen;
+    bool queue_all;             // Drained, the whole volume is to be saved
+    bool queue_flush;           // Requests were lost, every file is to be saved
+#endif
+#ifdef UTFS_ENABLE_COALESCE
+    uint32_t coalesce_quiet;    // See utfs_coalesce_set()
+    uint32_t coalesce_deadline;
+    bool save_pending;          // utfs_save() asked for, not written yet
+    uint32_t save_first;        // Ticks of the first and the last request
+    uint32_t save_last;
+#endif
+};
+
 // Functions
 // ----------------------------------------------------------------------------
 #ifdef __cplusplus
@@ -75,12 +424,38 @@ extern "C"
 
 utfs_result_e utfs_init(bool verbose);
 
+// Same as utfs_init(), but registered files are tracked in a caller owned
+// table of 'capacity' entries instead of the built-in UTFS_MAX_FILES table
+utfs_result_e utfs_init_table(bool verbose, utfs_file_t ** table, uint32_t capacity);
+
 utfs_result_e utfs_baseaddress_set(uint32_t baseaddr);
 
+// Limit the volume to 'size' bytes from the base address, so a save that
+// would not fit returns RES_FILESYSTEM_FULL before writing anything and
+// nothing after the region is read or written. 0, the default, for none.
+utfs_result_e utfs_size_set(uint32_t size);
+
+// Give the filename hash index 'count' buckets of the caller's, a power of
+// 2, instead of the built-in UTFS_HASH_BUCKETS. Finding a file by name
+// looks through files/buckets entries on average, so with a table from
+// utfs_init_table() use at least as many buckets as the table has
+// entries to keep that at one. NULL goes back to the built-in buckets.
+// Call it after utfs_init_table(), which starts with the built-in ones.
+utfs_result_e utfs_hash_set(utfs_file_t ** buckets, uint32_t count);
+
+// Give utfs_load() a buffer to read the medium into 'size' bytes at a time,
+// instead of a read per header and per file. NULL to stop using it.
+utfs_result_e utfs_scratch_set(void * buffer, uint32_t size);
+
 utfs_result_e utfs_register(utfs_file_t * f, utfs_flags_e flags, utfs_options_e options);
 utfs_result_e utfs_unregister(utfs_file_t * f);
 
 utfs_result_e utfs_load();
+
+// Write the files that changed. With UTFS_ENABLE_COALESCE and a quiet
+// interval, RES_OK only means the save is pending: nothing is written until
+// utfs_service() finds it due or utfs_commit() is called, and a write error
+// is returned by those.
 utfs_result_e utfs_save();
 
 // Write all files, including those with SAVE_EXPLICIT
@@ -89,12 +464,122 @@ utfs_result_e utfs_save_flush();
 utfs_result_e utfs_load_file(utfs_file_t * f);
 utfs_result_e utfs_save_file(utfs_file_t * f);
 
+// Non-blocking load and save. Each call moves about UTFS_STEP_SIZE bytes
+// and returns RES_BUSY until the operation is done, then its result. Other
+// calls that use the medium or the file list return RES_BUSY meanwhile,
+// as does a step of the other operation, without doing anything.
+// A file changed after the save has reached it is written by the next save.
+// On a log volume, a save that has to make room first takes one
+// compaction step per call.
+utfs_result_e utfs_load_step();
+utfs_result_e utfs_save_step();
+
+// Files loaded or saved so far by the running step operation, out of the
+// registered total. Returns RES_BUSY while one is running.
+utfs_result_e utfs_progress(uint32_t * done, uint32_t * total);
+
+// With UTFS_ENABLE_ASYNC, called by the port when the transfer it was given
+// has finished, from an interrupt or the main loop
+void utfs_io_done(uint32_t length);
+
+// Counts from the last load, for diagnostics. 'unmatched' is the number of
+// files read from the medium that are not registered; the load stops once
+// every registered file is found, so files after that are not counted.
+// 'missing' is the number of registered files that were not found.
+utfs_result_e utfs_load_stats(uint32_t * unmatched, uint32_t * missing);
+
+// Flag a file as changed, so the next utfs_save() writes it
+utfs_result_e utfs_mark_dirty(utfs_file_t * f);
+
+// With UTFS_ENABLE_SNAPSHOT, copy up to 'size' bytes of the registered file
+// 'f', as it was last loaded or saved, into 'buffer'. It never waits for a
+// save. RES_BUSY means nothing was copied: a save is writing over the file,
+// or saving it alone, or UTFS_SNAPSHOT_TRIES reads in a row were overtaken
+// by saves starting or ending. Call again later; once the save has ended
+// the file is read at its new place. RES_FILE_NOT_FOUND until its place on
+// the medium is known. Can be called from other threads or an interrupt,
+// as long as the port's read can.
+utfs_result_e utfs_snapshot_read(utfs_file_t * f, void * buffer, uint32_t size, uint32_t * length);
+
+// With UTFS_ENABLE_QUEUE, ask for 'f' to be saved by the next
+// utfs_service(), or the whole volume with NULL. Safe from an interrupt.
+// When the ring is full the next utfs_service() saves every file instead.
+utfs_result_e utfs_save_request(utfs_file_t * f);
+
+// Save what utfs_save_request() asked for, and with UTFS_ENABLE_COALESCE
+// a pending utfs_save() that is due. RES_BUSY while a step operation runs,
+// and the requests wait for the next call. Otherwise the first error; the
+// requests that failed are not tried again, a pending save is tried again
+// after a new quiet interval.
+utfs_result_e utfs_service();
+
+// With UTFS_ENABLE_COALESCE, write a pending utfs_save() once 'quiet' ticks
+// pass without another, or 'deadline' ticks after the first at the latest.
+// A quiet interval of 0 makes utfs_save() write at once, a deadline of 0
+// waits for the quiet interval however long it takes.
+utfs_result_e utfs_coalesce_set(uint32_t quiet, uint32_t deadline);
+
+// Write what is held back now: a pending utfs_save() with
+// UTFS_ENABLE_COALESCE, and the requests of utfs_save_request() with
+// UTFS_ENABLE_QUEUE. Call it before the medium goes away, at shutdown or
+// before switching it. RES_OK at once without either option, RES_BUSY
+// while a step operation runs.
+utfs_result_e utfs_commit();
+
+// With UTFS_ENABLE_LOG_VOLUME, do one step of a running compaction. Call it from
+// the main loop; it returns at once when there is nothing to do. A compaction
+// that runs out of room starts again from the erase, it returns
+// RES_FILESYSTEM_FULL if it runs out again with no save in between.
+utfs_result_e utfs_compact_step();
+
+
+// Volumes. Every call above has a utfs_vol_ form that works on the volume
+// it is given instead of the default one, so regions or devices with their
+// own port can be used at once. Each volume is used from one thread at a
+// time, unless UTFS_ENABLE_LOCK is set, and a file is registered with one
+// volume only.
+utfs_result_e utfs_vol_init(utfs_volume_t * v, const utfs_port_t * port, bool verbose);
+utfs_result_e utfs_vol_init_table(utfs_volume_t * v, const utfs_port_t * port, bool verbose, utfs_file_t ** table, uint32_t capacity);
+utfs_result_e utfs_vol_baseaddress_set(utfs_volume_t * v, uint32_t baseaddr);
+utfs_result_e utfs_vol_size_set(utfs_volume_t * v, uint32_t size);
+utfs_result_e utfs_vol_hash_set(utfs_volume_t * v, utfs_file_t ** buckets, uint32_t count);
+utfs_result_e utfs_vol_scratch_set(utfs_volume_t * v, void * buffer, uint32_t size);
+utfs_result_e utfs_vol_register(utfs_volume_t * v, utfs_file_t * f, utfs_flags_e flags, utfs_options_e options);
+utfs_result_e utfs_vol_unregister(utfs_volume_t * v, utfs_file_t * f);
+utfs_result_e utfs_vol_load(utfs_volume_t * v);
+utfs_result_e utfs_vol_save(utfs_volume_t * v);
+utfs_result_e utfs_vol_save_flush(utfs_volume_t * v);
+utfs_result_e utfs_vol_load_file(utfs_volume_t * v, utfs_file_t * f);
+utfs_result_e utfs_vol_save_file(utfs_volume_t * v, utfs_file_t * f);
+utfs_result_e utfs_vol_load_step(utfs_volume_t * v);
+utfs_result_e utfs_vol_save_step(utfs_volume_t * v);
+utfs_result_e utfs_vol_progress(utfs_volume_t * v, uint32_t * done, uint32_t * total);
+void utfs_vol_io_done(utfs_volume_t * v, uint32_t length);
+utfs_result_e utfs_vol_load_stats(utfs_volume_t * v, uint32_t * unmatched, uint32_t * missing);
+utfs_result_e utfs_vol_mark_dirty(utfs_volume_t * v, utfs_file_t * f);
+utfs_result_e utfs_vol_snapshot_read(utfs_volume_t * v, utfs_file_t * f, void * buffer, uint32_t size, uint32_t * length);
+utfs_result_e utfs_vol_save_request(utfs_volume_t * v, utfs_file_t * f);
+utfs_result_e utfs_vol_service(utfs_volume_t * v);
+utfs_result_e utfs_vol_coalesce_set(utfs_volume_t * v, uint32_t quiet, uint32_t deadline);
+utfs_result_e utfs_vol_commit(utfs_volume_t * v);
+utfs_result_e utfs_vol_compact_step(utfs_volume_t * v);
+utfs_result_e utfs_vol_status(utfs_volume_t * v);
+
+// The volume the calls without a utfs_volume_t use
+utfs_volume_t * utfs_default_volume();
 
 /// Utility functions
+// The name of a registered file can't change, these return RES_PARAM_ERROR.
+// Unregister it first, initialising its volume again unregisters it too.
 utfs_result_e utfs_set(utfs_file_t * f,char * name, void * data, uint32_t size);
 utfs_result_e utfs_set_filename(utfs_file_t * f,char * name);
 utfs_result_e utfs_set_data(utfs_file_t *f,void * data, uint32_t size);
 
+// Keep 'reserve' spare bytes after the file on the medium, so it can grow
+// by that much without moving the files after it. Takes effect the next
+// time the file is given a new position.
+utfs_result_e utfs_set_reserve(utfs_file_t * f, uint32_t reserve);
+
 uint16_t utfs_file_signature(utfs_file_t * f);
 utfs_result_e utfs_file_signature_set(utfs_file_t * f, uint16_t sig);
 
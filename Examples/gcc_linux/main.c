@@ -6,15 +6,48 @@
 #include <signal.h>
 #include <stdarg.h>
 #include <getopt.h>
+#include <time.h>
+#include <fcntl.h>
+#ifdef UTFS_ENABLE_LOCK
+#include <pthread.h>
+#endif
 
 #include "utfs.h"
 #include "sys.h"
 
 // Definitions
 // ----------------------------------------------------------------------------
+#define STRESS_THREADS  16      // Most threads, each with its own file, a power of 2
+#define STRESS_SIZE     256     // Bytes per file
+#define STRESS_TIME     500000  // Microseconds per thread count
+#define BENCH_INFLIGHT  8       // Volumes loading at once on the ring
+#define TEST_SIZE       1024    // Bytes of testbuffer, and of each bench image
 
 // Types and enums
 // ----------------------------------------------------------------------------
+#ifdef UTFS_ENABLE_LOCK
+typedef struct{
+    pthread_t thread;
+    utfs_file_t file;
+    uint8_t data[STRESS_SIZE];
+    uint32_t ops;
+    uint32_t bad;
+}stress_t;
+#endif
+
+#ifdef UTFS_ENABLE_ASYNC
+// One volume of the io_uring bench, on a file of its own
+typedef struct{
+    utfs_volume_t vol;      // First, so the port finds the slot from it
+    int fd;                 // -1 while the slot is free
+    uint32_t size;          // Bytes in the file, reads stop there
+    uint32_t index;
+    utfs_file_t appfile;
+    utfs_file_t benchfile;
+    uint32_t test_value;
+    uint8_t buffer[TEST_SIZE];
+}bench_slot_t;
+#endif
 
 // Variables
 // ----------------------------------------------------------------------------
@@ -22,7 +55,7 @@ bool g_running = false;
 bool g_verbose = true;
 
 // Testing buffer
-static uint8_t testbuffer[1024];
+static uint8_t testbuffer[TEST_SIZE];
 
 // UTFS file info
 
@@ -46,6 +79,14 @@ void sigint_handler(int arg)
     g_running = false;
 }
 
+#ifdef UTFS_ENABLE_QUEUE
+// Stands in for an interrupt, the save runs from the main loop
+void sigusr1_handler(int arg)
+{
+    utfs_save_request(&appfile);
+}
+#endif
+
 void help()
 {
     printf("Usage: main.bin [-vh?]\n");
@@ -95,6 +136,335 @@ void setup()
     return;
 }
 
+static double seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec+(ts.tv_nsec/1e9);
+}
+
+// The bench volumes are only loaded
+static uint32_t bench_none(uint32_t address, void * ptr, uint32_t length)
+{
+    return 0;
+}
+#ifdef UTFS_ENABLE_VECTORED
+static uint32_t bench_none_v(uint32_t address, utfs_iovec_t * iov, uint32_t count)
+{
+    return 0;
+}
+#endif
+#ifdef UTFS_ENABLE_ASYNC
+static bool bench_none_async(utfs_volume_t * v, uint32_t address, void * ptr, uint32_t length)
+{
+    return false;
+}
+#endif
+
+// Blocking pread() of the image, the baseline without the mapping
+static int bench_fd = -1;
+
+static uint32_t bench_pread(uint32_t address, void * ptr, uint32_t length)
+{
+    ssize_t n;
+
+    n = pread(bench_fd,ptr,length,address);
+    return (n>0)?(uint32_t)n:0;
+}
+#ifdef UTFS_ENABLE_VECTORED
+static uint32_t bench_preadv(uint32_t address, utfs_iovec_t * iov, uint32_t count)
+{
+    uint32_t x, n, got = 0;
+
+    for(x=0;x<count;x++){
+        n = bench_pread(address+got,iov[x].ptr,iov[x].length);
+        got += n;
+        if(n!=iov[x].length) break;
+    }
+    return got;
+}
+#endif
+
+static const utfs_port_t bench_pread_port = {
+    .write = bench_none,
+    .read = bench_pread,
+#ifdef UTFS_ENABLE_VECTORED
+    .writev = bench_none_v,
+    .readv = bench_preadv,
+#endif
+#ifdef UTFS_ENABLE_ASYNC
+    .write_async = bench_none_async,
+    .read_async = bench_none_async,
+#endif
+#ifdef UTFS_ENABLE_COALESCE
+    .tick = sys_tick,
+#endif
+};
+
+#ifdef UTFS_ENABLE_ASYNC
+// The ring volumes only load with steps, every transfer is on the ring
+static bool bench_read_async(utfs_volume_t * v, uint32_t address, void * ptr, uint32_t length)
+{
+    bench_slot_t * s = (bench_slot_t*)v;
+
+    return sys_uring_read(v,s->fd,s->size,address,ptr,length);
+}
+
+static bool bench_write_async(utfs_volume_t * v, uint32_t address, void * ptr, uint32_t length)
+{
+    return sys_uring_write(v,((bench_slot_t*)v)->fd,address,ptr,length);
+}
+
+static const utfs_port_t bench_port = {
+    .write = bench_none,
+    .read = bench_none,
+#ifdef UTFS_ENABLE_VECTORED
+    .writev = bench_none_v,
+    .readv = bench_none_v,
+#endif
+    .write_async = bench_write_async,
+    .read_async = bench_read_async,
+#ifdef UTFS_ENABLE_COALESCE
+    .tick = sys_tick,
+#endif
+};
+
+// Set the slot up to load image index
+static bool bench_slot_open(bench_slot_t * s, uint32_t index)
+{
+    char name[32];
+
+    sprintf(name,"bench%04d.dat",index);
+    s->fd = open(name,O_RDONLY);
+    if(s->fd<0) return false;
+    s->size = (uint32_t)lseek(s->fd,0,SEEK_END);
+    s->index = index;
+    s->test_value = ~0;
+    utfs_vol_init(&(s->vol),&bench_port,false);
+    utfs_set(&(s->appfile),"appdata",&(s->test_value),sizeof(s->test_value));
+    utfs_set(&(s->benchfile),"bench",s->buffer,sizeof(s->buffer));
+    utfs_vol_register(&(s->vol),&(s->appfile),UTFS_NOFLAGS,UTFS_NOOPT);
+    utfs_vol_register(&(s->vol),&(s->benchfile),UTFS_NOFLAGS,UTFS_NOOPT);
+    return true;
+}
+
+static void bench_slot_close(bench_slot_t * s)
+{
+    utfs_vol_unregister(&(s->vol),&(s->appfile));
+    utfs_vol_unregister(&(s->vol),&(s->benchfile));
+    close(s->fd);
+    s->fd = -1;
+    return;
+}
+#endif
+
+// Save count volumes, then time loading them back with the blocking
+// sys_read() from the mapping, with pread() from the file and, when built
+// with IO=uring, with BENCH_INFLIGHT volumes loading at once on the
+// io_uring backend
+void bench(uint32_t count)
+{
+    static utfs_file_t benchfile;
+    static utfs_volume_t pread_volume;
+    static utfs_file_t pread_app, pread_bench;
+    char name[32];
+    uint32_t x, bad;
+    double t, blocking, preads, uring;
+    app_data_t keep;
+    utfs_result_e ures;
+#ifdef UTFS_ENABLE_ASYNC
+    static bench_slot_t slots[BENCH_INFLIGHT];
+    bench_slot_t * s;
+    uint32_t next, active;
+#endif
+
+    // A save held back would be lost with the volume
+    if(utfs_commit()!=RES_OK) printf("Pending save failed\n");
+    memcpy(&keep,&appdata,sizeof(appdata));
+    sys_verbose(false);
+    utfs_init(false);
+    utfs_set(&benchfile,"bench",testbuffer,sizeof(testbuffer));
+    utfs_register(&appfile, UTFS_NOFLAGS, UTFS_NOOPT);
+    utfs_register(&benchfile, UTFS_NOFLAGS, UTFS_NOOPT);
+
+    // Write the images
+    for(x=0;x<count;x++){
+        sprintf(name,"bench%04d.dat",x);
+        sys_open(name);
+        appdata.test_value = x;
+        memset(testbuffer,(uint8_t)x,sizeof(testbuffer));
+        utfs_save_flush();
+    }
+
+    // One blocking read per header and per file
+    bad = 0;
+    t = seconds();
+    for(x=0;x<count;x++){
+        sprintf(name,"bench%04d.dat",x);
+        sys_open(name);
+        appdata.test_value = ~0;
+        ures = utfs_load();
+        if(ures!=RES_OK || appdata.test_value!=x || testbuffer[0]!=(uint8_t)x) bad++;
+    }
+    sys_close();
+    blocking = count/(seconds()-t);
+    printf("sys_read: %d volumes, %.0f volumes/s, %d bad\n",count,blocking,bad);
+
+    // The same loads with a pread() system call per read
+    utfs_vol_init(&pread_volume,&bench_pread_port,false);
+    utfs_set(&pread_app,"appdata",&appdata,sizeof(appdata));
+    utfs_set(&pread_bench,"bench",testbuffer,sizeof(testbuffer));
+    utfs_vol_register(&pread_volume,&pread_app,UTFS_NOFLAGS,UTFS_NOOPT);
+    utfs_vol_register(&pread_volume,&pread_bench,UTFS_NOFLAGS,UTFS_NOOPT);
+    bad = 0;
+    t = seconds();
+    for(x=0;x<count;x++){
+        sprintf(name,"bench%04d.dat",x);
+        bench_fd = open(name,O_RDONLY);
+        appdata.test_value = ~0;
+        ures = utfs_vol_load(&pread_volume);
+        if(ures!=RES_OK || appdata.test_value!=x || testbuffer[0]!=(uint8_t)x) bad++;
+        if(bench_fd>=0) close(bench_fd);
+        bench_fd = -1;
+    }
+    preads = count/(seconds()-t);
+    printf("pread: %d volumes, %.0f volumes/s, %d bad\n",count,preads,bad);
+    utfs_vol_unregister(&pread_volume,&pread_app);
+    utfs_vol_unregister(&pread_volume,&pread_bench);
+
+#ifdef UTFS_ENABLE_ASYNC
+    // Step loads of several volumes, each on a slot of its own. Every
+    // slot whose transfer has finished starts its next one, and the poll
+    // hands them to the kernel together.
+    if(sys_uring_init(BENCH_INFLIGHT)){
+        for(x=0;x<BENCH_INFLIGHT;x++) slots[x].fd = -1;
+        bad = 0;
+        next = 0;
+        t = seconds();
+        do{
+            active = 0;
+            for(x=0;x<BENCH_INFLIGHT;x++){
+                s = &(slots[x]);
+                while(s->fd>=0 || next<count){
+                    if(s->fd<0 && !bench_slot_open(s,next++)){
+                        bad++;
+                        continue;
+                    }
+                    ures = utfs_vol_load_step(&(s->vol));
+                    if(ures==RES_BUSY){
+                        active++;
+                        break;
+                    }
+                    if(ures!=RES_OK || s->test_value!=s->index || s->buffer[0]!=(uint8_t)s->index) bad++;
+                    bench_slot_close(s);
+                }
+            }
+            if(active>0) sys_uring_poll(true);
+        }while(active>0);
+        uring = count/(seconds()-t);
+        printf("io_uring: %d volumes, %d at once, %.0f volumes/s, %d bad\n",count,BENCH_INFLIGHT,uring,bad);
+        sys_uring_exit();
+    }
+#endif
+
+    for(x=0;x<count;x++){
+        sprintf(name,"bench%04d.dat",x);
+        unlink(name);
+    }
+
+    // Back to the REPL volume
+    sys_open("UTFS.dat");
+    sys_verbose(true);
+    utfs_init(g_verbose);
+    utfs_register(&appfile, UTFS_NOFLAGS, UTFS_NOOPT);
+    memcpy(&appdata,&keep,sizeof(appdata));
+    return;
+}
+
+#ifdef UTFS_ENABLE_LOCK
+static utfs_volume_t stress_volume;
+static utfs_file_t * stress_table[STRESS_THREADS];
+static utfs_file_t * stress_buckets[STRESS_THREADS];
+static stress_t stress[STRESS_THREADS];
+static bool stress_running;
+
+// Save and load back one file as fast as possible, checking every load
+static void * stress_thread(void * arg)
+{
+    stress_t * s = (stress_t*)arg;
+    uint8_t value = 0;
+    uint32_t x;
+
+    while(__atomic_load_n(&stress_running,__ATOMIC_RELAXED)){
+        value++;
+        memset(s->data,value,sizeof(s->data));
+        if(utfs_vol_save_file(&stress_volume,&s->file)!=RES_OK) s->bad++;
+        memset(s->data,0,sizeof(s->data));
+        if(utfs_vol_load_file(&stress_volume,&s->file)!=RES_OK) s->bad++;
+        for(x=0;x<sizeof(s->data);x++){
+            if(s->data[x]!=value){ s->bad++; break; }
+        }
+        s->ops += 2;
+    }
+    return NULL;
+}
+
+// Threads each saving and loading their own file on one volume, doubling
+// the thread count up to max
+void stress_test(uint32_t max)
+{
+    char name[UTFS_MAX_FILENAME+1];
+    uint32_t x, count, ops, bad;
+    double t;
+
+    if(max>STRESS_THREADS) max = STRESS_THREADS;
+    if(utfs_commit()!=RES_OK) printf("Pending save failed\n");
+    sys_verbose(false);
+    sys_open("stress.dat");
+
+    // Lay out every file once, after that saves are in place
+    utfs_vol_init_table(&stress_volume,utfs_default_volume()->port,false,stress_table,STRESS_THREADS);
+    utfs_vol_hash_set(&stress_volume,stress_buckets,STRESS_THREADS);
+    for(x=0;x<max;x++){
+        sprintf(name,"stress%02d",x);
+        utfs_set(&stress[x].file,name,stress[x].data,sizeof(stress[x].data));
+        utfs_vol_register(&stress_volume,&stress[x].file,UTFS_NOFLAGS,UTFS_NOOPT);
+    }
+    utfs_vol_save_flush(&stress_volume);
+
+    for(count=1;;count*=2){
+        if(count>max) count = max;
+        __atomic_store_n(&stress_running,true,__ATOMIC_RELAXED);
+        for(x=0;x<count;x++){
+            stress[x].ops = 0;
+            stress[x].bad = 0;
+            pthread_create(&stress[x].thread,NULL,stress_thread,&stress[x]);
+        }
+        t = seconds();
+        usleep(STRESS_TIME);
+        __atomic_store_n(&stress_running,false,__ATOMIC_RELAXED);
+        ops = 0;
+        bad = 0;
+        for(x=0;x<count;x++){
+            pthread_join(stress[x].thread,NULL);
+            ops += stress[x].ops;
+            bad += stress[x].bad;
+        }
+        t = seconds()-t;
+        printf("%2d threads: %.0f file ops/s, %d bad\n",count,ops/t,bad);
+        if(count==max) break;
+    }
+
+    sys_close();
+    unlink("stress.dat");
+
+    // Back to the REPL volume
+    sys_open("UTFS.dat");
+    sys_verbose(true);
+    return;
+}
+#endif
+
 void command_process(char * input)
 {
     // This is called from
@@ -127,6 +497,10 @@ void command_process(char * input)
         printf("utfs  - Show info about the UTFS filsystem\n");
         printf("status- Show appdata\n");
         printf("value NUM - Set the test value to NUM\n");
+        printf("bench NUM - Time loading NUM volumes\n");
+#ifdef UTFS_ENABLE_LOCK
+        printf("stress NUM - File ops/s from 1 up to NUM threads\n");
+#endif
         printf("\n");
     }else if(cmp_const(input,"load")){
         utfs_load();
@@ -150,6 +524,24 @@ void command_process(char * input)
         }
 
 
+    }else if(cmp_const(input,"bench")){
+        char * pch;
+        uint32_t count = 1000;
+        pch = strtok(input," ,");
+        pch = strtok(NULL," ,");
+        if(pch) count = atoi(pch);
+        if(count>0) bench(count);
+
+#ifdef UTFS_ENABLE_LOCK
+    }else if(cmp_const(input,"stress")){
+        char * pch;
+        uint32_t count = 8;
+        pch = strtok(input," ,");
+        pch = strtok(NULL," ,");
+        if(pch) count = atoi(pch);
+        if(count>0) stress_test(count);
+#endif
+
     }else if(cmp_const(input,"testread")){
         int size;
         size = 512;
@@ -216,6 +608,9 @@ int main(int argc,char** argv)
     g_running = true;
     signal(SIGINT, sigint_handler);
     signal(SIGTERM, sigint_handler);
+#ifdef UTFS_ENABLE_QUEUE
+    signal(SIGUSR1, sigusr1_handler);
+#endif
     
     setup();
 
@@ -271,12 +666,16 @@ int main(int argc,char** argv)
 		} // end select
 		
 		//loop
+#if defined(UTFS_ENABLE_QUEUE) || defined(UTFS_ENABLE_COALESCE)
+		if(utfs_service()!=RES_OK) printf("Requested save failed\n");
+#endif
 		
 	} // end while
 	
 	
-	// Shutdown the system, flush the data
-	sys_flush();
+	// Shutdown the system, write what is held back and flush the data
+	if(utfs_commit()!=RES_OK) printf("Pending save failed\n");
+	sys_close();
 
 	// Shutdown system	
     printf("Terminating\n");
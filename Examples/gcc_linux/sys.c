@@ -1,177 +1,525 @@
+#define _GNU_SOURCE     // mremap()
 #include "defs.h"
 
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
-
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#ifdef UTFS_ENABLE_LOCK
+#include <pthread.h>
+#endif
+
+#include "utfs.h"
 #include "sys.h"
 
+// The volume file is mapped in to memory. The mapping grows geometrically,
+// the file is extended with it and cut back to the volume size on close.
+// The mapping stays in place across flushes, and only the pages written
+// since the last flush are synced.
+#define SYS_MAP_MIN         4096    // Smallest mapping, bytes
+#define SYS_DIRTY_RANGES    8       // Dirty ranges tracked before merging
+#define SYS_SYNC_BATCH      1       // Flushes per fdatasync(), 1 = every flush waits
+
+#define sys_log(...)    do{ if(sys_logging) printf(__VA_ARGS__); }while(0)
+
+// With UTFS_ENABLE_LOCK, UTFS calls sys_read() and sys_write() from several
+// threads at once. Copies in and out of the mapping hold it shared and lock
+// only the page stripes they touch, so transfers to other ranges go ahead
+// together. Mapping, growing and unmapping hold it exclusive, and the dirty
+// ranges and the volume end have their own short lock.
+#define SYS_RANGE_LOCKS     16      // Page stripes, a page locks page%SYS_RANGE_LOCKS
+
+#ifdef UTFS_ENABLE_LOCK
+static pthread_rwlock_t sys_map_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t sys_state_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t sys_range_mutex[SYS_RANGE_LOCKS] = { [0 ... SYS_RANGE_LOCKS-1] = PTHREAD_MUTEX_INITIALIZER };
+#define sys_map_shared()    pthread_rwlock_rdlock(&sys_map_lock)
+#define sys_map_own()       pthread_rwlock_wrlock(&sys_map_lock)
+#define sys_map_release()   pthread_rwlock_unlock(&sys_map_lock)
+#define sys_state_lock()    pthread_mutex_lock(&sys_state_mutex)
+#define sys_state_unlock()  pthread_mutex_unlock(&sys_state_mutex)
+#else
+#define sys_map_shared()
+#define sys_map_own()
+#define sys_map_release()
+#define sys_state_lock()
+#define sys_state_unlock()
+#define sys_range_lock(address,length)
+#define sys_range_unlock(address,length)
+#endif
+
+typedef struct{
+    uint32_t start;
+    uint32_t end;
+}sys_range_t;
+
 // Buffer and file variables
-static char outfilename[] = "UTFS.dat";
+static char outfilename[64] = "UTFS.dat";
+static bool sys_logging = true;
+static int utfs_fd;
 static uint8_t * utfs_buffer;
 static uint32_t utfs_buffer_size;
-static uint32_t utfs_buffer_maxindex;
-static uint32_t utfs_buffer_loadedsize;
+static uint32_t utfs_volume_end;    // Bytes of the file the volume has used, only grows
+static uint32_t utfs_page_size;
+static sys_range_t utfs_dirty[SYS_DIRTY_RANGES];
+static uint32_t utfs_dirty_count;
+static uint32_t utfs_flush_count;
 
 
 static void sys_free_buffer()
 {
     if(utfs_buffer)
     {
-        printf("Freeing %d bytes\n",utfs_buffer_size);
-        free(utfs_buffer);
+        sys_log("Unmapping %d bytes\n",utfs_buffer_size);
+        munmap(utfs_buffer,utfs_buffer_size);
         utfs_buffer=NULL;
     }
+    if(utfs_fd>=0)
+    {
+        close(utfs_fd);
+        utfs_fd=-1;
+    }
     utfs_buffer_size=0;
-    utfs_buffer_maxindex=0;
+    utfs_volume_end=0;
+    utfs_dirty_count=0;
+    utfs_flush_count=0;
+    return;
+}
+
+static uint32_t sys_page_round(uint32_t size)
+{
+    return (size+utfs_page_size-1)&~(utfs_page_size-1);
+}
+
+#ifdef UTFS_ENABLE_LOCK
+// Stripes of the pages from address for length bytes, one bit each
+static uint32_t sys_range_mask(uint32_t address, uint32_t length)
+{
+    uint32_t page, last, mask = 0;
+
+    if(length==0) return 0;
+    page = address/utfs_page_size;
+    last = (address+length-1)/utfs_page_size;
+    if(last-page>=SYS_RANGE_LOCKS) return (1u<<SYS_RANGE_LOCKS)-1;
+    for(;page<=last;page++) mask |= 1u<<(page%SYS_RANGE_LOCKS);
+    return mask;
+}
+
+// Always in stripe order, so two transfers can't wait on each other
+static void sys_range_lock(uint32_t address, uint32_t length)
+{
+    uint32_t x, mask;
+
+    mask = sys_range_mask(address,length);
+    for(x=0;x<SYS_RANGE_LOCKS;x++){
+        if(mask&(1u<<x)) pthread_mutex_lock(&sys_range_mutex[x]);
+    }
+    return;
+}
+
+static void sys_range_unlock(uint32_t address, uint32_t length)
+{
+    uint32_t x, mask;
+
+    mask = sys_range_mask(address,length);
+    for(x=0;x<SYS_RANGE_LOCKS;x++){
+        if(mask&(1u<<x)) pthread_mutex_unlock(&sys_range_mutex[x]);
+    }
+    return;
+}
+#endif
+
+// Open and map the file, a missing file is only created for a write
+static bool sys_map_file(bool create)
+{
+    struct stat st;
+    uint32_t size;
+    void * map;
+
+    if(utfs_buffer) return true;
+
+    utfs_fd = open(outfilename, O_RDWR|(create?O_CREAT:0), S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP);
+    if(utfs_fd<0){
+        if(create) printf("Error opening file %s\n",outfilename);
+        return false;
+    }
+    if(fstat(utfs_fd,&st)<0){
+        printf("Error fstat %s\n",outfilename);
+        sys_free_buffer();
+        return false;
+    }
+
+    // Extend the file to cover the whole mapping, writes past the end of
+    // the file would otherwise not reach it
+    size = (uint32_t)st.st_size;
+    if(size<SYS_MAP_MIN) size = SYS_MAP_MIN;
+    size = sys_page_round(size);
+    if(size>(uint32_t)st.st_size && ftruncate(utfs_fd,size)<0){
+        printf("Error extending file to %d bytes\n",size);
+        sys_free_buffer();
+        return false;
+    }
+
+    map = mmap(NULL,size,PROT_READ|PROT_WRITE,MAP_SHARED,utfs_fd,0);
+    if(map==MAP_FAILED){
+        printf("Error mapping %d bytes\n",size);
+        sys_free_buffer();
+        return false;
+    }
+    sys_log("Mapped %d bytes, file %d bytes\n",size,(int)st.st_size);
+    utfs_buffer = (uint8_t*)map;
+    utfs_buffer_size = size;
+    utfs_volume_end = (uint32_t)st.st_size;
+    utfs_dirty_count = 0;
+    return true;
+}
+
+// Double the mapping until it holds size bytes
+static bool sys_grow(uint32_t size)
+{
+    uint32_t newsize;
+    void * map;
+
+    newsize = utfs_buffer_size;
+    while(newsize<size){
+        if(newsize>0x7FFFFFFF) return false;
+        newsize <<= 1;
+    }
+
+    if(ftruncate(utfs_fd,newsize)<0){
+        printf("Error extending file to %d bytes\n",newsize);
+        return false;
+    }
+    map = mremap(utfs_buffer,utfs_buffer_size,newsize,MREMAP_MAYMOVE);
+    if(map==MAP_FAILED){
+        printf("Error remapping to %d bytes\n",newsize);
+        return false;
+    }
+    sys_log("Grow map to %d bytes\n",newsize);
+    utfs_buffer = (uint8_t*)map;
+    utfs_buffer_size = newsize;
+    return true;
+}
+
+// Record the pages of a write, ranges that touch are merged and when the
+// table is full the two closest ranges are joined
+static void sys_mark_dirty(uint32_t address, uint32_t length)
+{
+    uint32_t start, end;
+    uint32_t x, best, gap, bestgap;
+
+    start = address&~(utfs_page_size-1);
+    end = sys_page_round(address+length);
+
+    for(x=0;x<utfs_dirty_count;x++){
+        if(start<=utfs_dirty[x].end && end>=utfs_dirty[x].start){
+            if(start<utfs_dirty[x].start) utfs_dirty[x].start = start;
+            if(end>utfs_dirty[x].end) utfs_dirty[x].end = end;
+            return;
+        }
+    }
+
+    if(utfs_dirty_count==SYS_DIRTY_RANGES){
+        best = 0;
+        bestgap = 0xFFFFFFFF;
+        for(x=0;x<utfs_dirty_count;x++){
+            gap = (start>utfs_dirty[x].end)?(start-utfs_dirty[x].end):(utfs_dirty[x].start-end);
+            if(gap<bestgap){ best = x; bestgap = gap; }
+        }
+        if(start<utfs_dirty[best].start) utfs_dirty[best].start = start;
+        if(end>utfs_dirty[best].end) utfs_dirty[best].end = end;
+        return;
+    }
+
+    utfs_dirty[utfs_dirty_count].start = start;
+    utfs_dirty[utfs_dirty_count].end = end;
+    utfs_dirty_count++;
     return;
 }
 
 
 void sys_init()
 {
+    utfs_fd=-1;
     utfs_buffer=NULL;
     utfs_buffer_size=0;
-    utfs_buffer_maxindex=0;
-    utfs_buffer_loadedsize=0;
+    utfs_volume_end=0;
+    utfs_dirty_count=0;
+    utfs_flush_count=0;
+    utfs_page_size=(uint32_t)sysconf(_SC_PAGESIZE);
 
     return;
 }
 
-uint32_t sys_write(uint32_t address, void * ptr, uint32_t length)
+void sys_verbose(bool on)
 {
-    uint8_t * dataptr;
+    sys_logging = on;
+    return;
+}
 
-    // Can't write empty data
-    if(!ptr || length==0) return 0;
+bool sys_open(const char * filename)
+{
+    bool ok;
 
+    // Finish with the current file first
+    ok = sys_close();
+    strncpy(outfilename,filename,sizeof(outfilename)-1);
+    return ok;
+}
 
-    // If the buffer is not big enough, resize it
-    if(address+length>utfs_buffer_size){
-        uint32_t size;
-        uint8_t * newbuffer;
+// Hold the mapping shared, mapped and holding end bytes. When it isn't,
+// it is mapped or grown under the exclusive hold first. False with nothing
+// held if the file can't be mapped or grown.
+static bool sys_hold(bool create, uint32_t end)
+{
+    bool ok;
 
-        size = address+length;
+    // Another thread can close the file between the holds, so check again
+    for(;;){
+        sys_map_shared();
+        if(utfs_buffer && end<=utfs_buffer_size) return true;
+        sys_map_release();
 
-        printf("Realloc to %d bytes\n",size);
-        newbuffer = realloc(utfs_buffer,size);
-        if(!newbuffer){
+        sys_map_own();
+        ok = sys_map_file(create);
+        if(ok && end>utfs_buffer_size && !sys_grow(end)){
             printf("Error resizing buffer \n");
-            return 0;
+            ok = false;
         }
-        utfs_buffer = newbuffer;
-        utfs_buffer_size = size;
+        sys_map_release();
+        if(!ok) return false;
     }
+}
 
-    // Write the section in the RAM buffer
-    dataptr = (uint8_t*)ptr;
-    memcpy(&(utfs_buffer[address]),dataptr,length);
-    if(address+length>utfs_buffer_maxindex) utfs_buffer_maxindex = address+length;
+int sys_fd()
+{
+    int fd;
+
+    if(!sys_hold(false,0)) return -1;
+    fd = utfs_fd;
+    sys_map_release();
+    return fd;
+}
+
+uint32_t sys_size()
+{
+    uint32_t size;
+
+    if(!sys_hold(false,0)) return 0;
+    sys_state_lock();
+    size = utfs_volume_end;
+    sys_state_unlock();
+    sys_map_release();
+    return size;
+}
+
+// Record a write in the held mapping
+static void sys_claim(uint32_t address, uint32_t length)
+{
+    sys_state_lock();
+    sys_mark_dirty(address,length);
+    if(address+length>utfs_volume_end) utfs_volume_end = address+length;
+    sys_state_unlock();
+    return;
+}
 
+// Bytes of a read from address that are in the volume, not the mapping
+static uint32_t sys_bound(uint32_t address, uint32_t length)
+{
+    sys_state_lock();
+    if(address>=utfs_volume_end) length = 0;
+    else if(address+length>utfs_volume_end) length = utfs_volume_end-address;
+    sys_state_unlock();
     return length;
 }
-uint32_t sys_read(uint32_t address, void * ptr, uint32_t length)
+
+int sys_write_fd(uint32_t address, uint32_t length)
 {
-    int fsize;
-    int rsize;
-    uint8_t * dataptr;
+    int fd;
 
-    // If the buffer is not created, create it and load
-    // the entire file in
-    if(utfs_buffer_size==0)
-    {
-        int fd;
-        uint8_t * newbuffer;
-
-        // Try and open the file
-        fd = open(outfilename, O_RDONLY, 0);
-        if(!fd){
-            printf("Error opening file %s\n",outfilename);
-            return 0;
-        }
-        // Get file size, allocate
-        fsize = lseek(fd,0,SEEK_END);
-        if(fsize<=0){
-            printf("Error lseek %d\n",fsize);
-            close(fd);
-            return 0;
-        }
-        lseek(fd,0,SEEK_SET);
-
-        // Allocate the memory
-        printf("Realloc to %d bytes\n",fsize);
-        newbuffer = realloc(utfs_buffer,fsize);
-        if(!newbuffer){
-            printf("Error allocating file\n");
-            close(fd);
-            return 0;
-        }
-        utfs_buffer = newbuffer;
-        utfs_buffer_size = fsize;
-        utfs_buffer_maxindex=0;
-        utfs_buffer_loadedsize=fsize;
-        memset(utfs_buffer,0,utfs_buffer_size);
-        printf("New buffer size %d bytes\n",utfs_buffer_size);
-
-        // Read file in to memory
-        rsize = read(fd, utfs_buffer, utfs_buffer_size);
-        if(rsize!=utfs_buffer_size){
-            printf("Didn't read entire file, %d != %d\n",rsize,utfs_buffer_size);
-        }
+    if(!sys_hold(true,address+length)) return -1;
+    sys_claim(address,length);
+    fd = utfs_fd;
+    sys_map_release();
+    return fd;
+}
 
-        // Close file
-        close(fd);
-    }
+uint32_t sys_write(uint32_t address, void * ptr, uint32_t length)
+{
+    // Can't write empty data
+    if(!ptr || length==0) return 0;
 
-    // Bounds check
-    if(address>utfs_buffer_size) return 0;
-    if(address+length>=utfs_buffer_size) length = utfs_buffer_size-address;
+    if(!sys_hold(true,address+length)) return 0;
+    sys_claim(address,length);
 
-    // From the file in memory, get the section
-    printf("sys_read: addr %d, %d bytes\n",address,length);
-    dataptr = (uint8_t*)ptr;
-    memcpy(dataptr,&(utfs_buffer[address]),length);
+    // Write the section in the mapping
+    sys_range_lock(address,length);
+    memcpy(&(utfs_buffer[address]),ptr,length);
+    sys_range_unlock(address,length);
 
+    sys_map_release();
     return length;
 }
-bool sys_flush()
+uint32_t sys_read(uint32_t address, void * ptr, uint32_t length)
 {
-    int fd;
-    uint32_t writesize;
+    // Map the file on the first access
+    if(!sys_hold(false,0)){
+        printf("Error opening file %s\n",outfilename);
+        return 0;
+    }
+    length = sys_bound(address,length);
 
-    if(utfs_buffer_maxindex==0){
-        // We did not write data, so use the size of the file
-        // read in
-        writesize = utfs_buffer_loadedsize;
-    }else{
-        writesize = utfs_buffer_maxindex;
+    // From the mapping, get the section
+    sys_log("sys_read: addr %d, %d bytes\n",address,length);
+    sys_range_lock(address,length);
+    memcpy(ptr,&(utfs_buffer[address]),length);
+    sys_range_unlock(address,length);
+
+    sys_map_release();
+    return length;
+}
+#ifdef UTFS_ENABLE_VECTORED
+// The ranges follow on from each other, they are copied under one hold of
+// the mapping and of the stripes they cover
+uint32_t sys_writev(uint32_t address, utfs_iovec_t * iov, uint32_t count)
+{
+    uint32_t x, total = 0, written = 0;
+
+    for(x=0;x<count;x++){
+        if(!iov[x].ptr && iov[x].length) break;
+        total += iov[x].length;
+    }
+    count = x;
+    if(total==0) return 0;
+
+    if(!sys_hold(true,address+total)) return 0;
+    sys_claim(address,total);
+    sys_range_lock(address,total);
+    for(x=0;x<count;x++){
+        memcpy(&(utfs_buffer[address+written]),iov[x].ptr,iov[x].length);
+        written += iov[x].length;
     }
+    sys_range_unlock(address,total);
+    sys_map_release();
+    return written;
+}
+uint32_t sys_readv(uint32_t address, utfs_iovec_t * iov, uint32_t count)
+{
+    uint32_t x, n, total = 0, got = 0;
 
+    if(!sys_hold(false,0)){
+        printf("Error opening file %s\n",outfilename);
+        return 0;
+    }
+    for(x=0;x<count;x++) total += iov[x].length;
+    total = sys_bound(address,total);
+
+    sys_range_lock(address,total);
+    for(x=0;x<count && got<total;x++){
+        n = iov[x].length;
+        if(n>total-got) n = total-got;
+        memcpy(iov[x].ptr,&(utfs_buffer[address+got]),n);
+        got += n;
+    }
+    sys_range_unlock(address,total);
+    sys_map_release();
+    return got;
+}
+#endif
+// With the mapping held, sync the dirty ranges
+static bool sys_sync()
+{
+    uint32_t x, length;
+    bool ok = true;
+    bool wait;
 
-    if(writesize==0){
-        printf("Write size is 0, no data was loaded or written, skip writing\n");
-    }else{
+    if(!utfs_buffer){
+        sys_log("Write size is 0, no data was loaded or written, skip writing\n");
+        return true;
+    }
 
-        // Open the file and overwrite if it exists
-        fd = open(outfilename, O_CREAT|O_TRUNC|O_WRONLY, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP);
-        if(!fd){
-            printf("Error opening file %s\n",outfilename);
-            return false;
+    // Only every SYS_SYNC_BATCH flush waits for the disk, the others
+    // start the write back of their pages
+    utfs_flush_count++;
+    wait = (utfs_flush_count%SYS_SYNC_BATCH)==0;
+
+    // Sync only the pages that were written
+    for(x=0;x<utfs_dirty_count;x++){
+        length = utfs_dirty[x].end-utfs_dirty[x].start;
+        if(msync(&(utfs_buffer[utfs_dirty[x].start]),length,(wait&&SYS_SYNC_BATCH==1)?MS_SYNC:MS_ASYNC)<0){
+            printf("Error syncing %d bytes at %d\n",length,utfs_dirty[x].start);
+            ok = false;
         }
+    }
+    if(wait && SYS_SYNC_BATCH>1 && fdatasync(utfs_fd)<0){
+        printf("Error fdatasync %s\n",outfilename);
+        ok = false;
+    }
+    sys_log("Synced %d ranges%s\n",utfs_dirty_count,wait?"":", not waited");
 
+    // The file keeps its size. A save that only wrote part of the volume,
+    // utfs_save_file() or an incremental save, says nothing about where it
+    // ends, and bytes left after a smaller volume are never loaded: the
+    // load stops once every registered file is found.
+    utfs_dirty_count = 0;
 
+    return ok;
+}
+bool sys_flush()
+{
+    bool ok;
+
+    // Writes to other ranges carry on, only the dirty table waits
+    sys_map_shared();
+    sys_state_lock();
+    ok = sys_sync();
+    sys_state_unlock();
+    sys_map_release();
+    return ok;
+}
+#ifdef UTFS_ENABLE_COALESCE
+// Time base of coalesced saves, milliseconds
+uint32_t sys_tick(void)
+{
+    struct timespec ts;
 
-        // From the file in memory, write it to the file
-        write(fd,utfs_buffer,writesize);
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (uint32_t)((ts.tv_sec*1000)+(ts.tv_nsec/1000000));
+}
+#endif
+bool sys_close()
+{
+    uint32_t size;
+    bool ok;
+
+    sys_map_own();
+    ok = sys_sync();
+    if(!utfs_buffer){
+        sys_map_release();
+        return ok;
+    }
+    if(utfs_flush_count%SYS_SYNC_BATCH && fdatasync(utfs_fd)<0){
+        printf("Error fdatasync %s\n",outfilename);
+        ok = false;
+    }
 
-        close(fd);
+    // Cut the file back from the mapping to the volume. This is the
+    // furthest the volume has reached, the tail of a volume that got
+    // smaller stays as it was.
+    size = utfs_volume_end;
+    if(ftruncate(utfs_fd,size)<0){
+        printf("Error truncating file to %d bytes\n",size);
+        ok = false;
     }
 
-    // free the buffer
+    // unmap the file
     sys_free_buffer();
+    sys_map_release();
 
-    return true;
+    return ok;
 }
 
 // EOF
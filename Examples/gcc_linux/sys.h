@@ -7,7 +7,49 @@ uint32_t sys_write(uint32_t address, void * ptr, uint32_t length);
 
 uint32_t sys_read(uint32_t address, void * ptr, uint32_t length);
 
+#ifdef UTFS_ENABLE_VECTORED
+// One call for ranges that follow on from each other on the medium
+uint32_t sys_writev(uint32_t address, utfs_iovec_t * iov, uint32_t count);
+
+uint32_t sys_readv(uint32_t address, utfs_iovec_t * iov, uint32_t count);
+#endif
+
 bool sys_flush();
 
+#ifdef UTFS_ENABLE_COALESCE
+// Milliseconds, the time base of coalesced saves
+uint32_t sys_tick(void);
+#endif
+
+bool sys_close();
+
+// Switch to another volume file, the current one is closed
+bool sys_open(const char * filename);
+
+// Descriptor of the open volume file, or -1 if it doesn't exist
+int sys_fd();
+
+// Bytes of the open volume file in use, sys_read() stops there
+uint32_t sys_size();
+
+// Descriptor for a write of length bytes at address that doesn't go through
+// sys_write(), the file is grown to hold it and the bytes are synced by the
+// next sys_flush(). -1 if the file can't be created or grown.
+int sys_write_fd(uint32_t address, uint32_t length);
+
+void sys_verbose(bool on);
+
+#ifdef UTFS_ENABLE_ASYNC
+// io_uring transfers for sys_read_async() / sys_write_async(), see sys_uring.c
+bool sys_uring_init(uint32_t entries);
+void sys_uring_exit();
+uint32_t sys_uring_poll(bool wait);
+
+// Queue a transfer on fd for the volume v, for ports of other volumes.
+// Reads stop at size, the bytes in the file.
+bool sys_uring_read(utfs_volume_t * v, int fd, uint32_t size, uint32_t address, void * ptr, uint32_t length);
+bool sys_uring_write(utfs_volume_t * v, int fd, uint32_t address, void * ptr, uint32_t length);
+#endif
+
 
 #endif
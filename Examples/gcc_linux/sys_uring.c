@@ -0,0 +1,222 @@
+#include "defs.h"
+
+#include "utfs.h"
+#include "sys.h"
+
+#ifdef UTFS_ENABLE_ASYNC
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+// UTFS transfers on an io_uring, set up with the raw system calls so the
+// port doesn't need liburing. Each transfer carries its volume in the
+// entry's user_data, so any number of volumes can have one in flight.
+// Transfers are only queued when started, and sys_uring_poll() hands all
+// of them to the kernel with a single io_uring_enter(). Writes of the
+// default volume go to the volume file, sys.c grows it and syncs them.
+
+typedef struct{
+    unsigned * head;
+    unsigned * tail;
+    unsigned * mask;
+    unsigned * array;
+    struct io_uring_sqe * sqes;
+}sys_sq_t;
+
+typedef struct{
+    unsigned * head;
+    unsigned * tail;
+    unsigned * mask;
+    struct io_uring_cqe * cqes;
+}sys_cq_t;
+
+// Ring variables
+static int ring_fd = -1;
+static sys_sq_t ring_sq;
+static sys_cq_t ring_cq;
+static void * ring_sq_map;
+static void * ring_cq_map;
+static uint32_t ring_sq_size;
+static uint32_t ring_cq_size;
+static uint32_t ring_sqes_size;
+static uint32_t ring_entries;
+static uint32_t ring_queued;    // Entries not yet handed to the kernel
+static uint32_t ring_inflight;  // Transfers queued or running
+
+
+static int sys_uring_enter(uint32_t submit, uint32_t wait)
+{
+    return (int)syscall(__NR_io_uring_enter,ring_fd,submit,wait,wait?IORING_ENTER_GETEVENTS:0,NULL,0);
+}
+
+// Queue one read or write, the next sys_uring_poll() submits it
+static bool sys_uring_queue(uint8_t opcode, utfs_volume_t * v, int fd, uint32_t address, void * ptr, uint32_t length)
+{
+    unsigned tail, index;
+    struct io_uring_sqe * sqe;
+
+    // The completion ring holds twice the entries, so it can't overflow
+    if(ring_fd<0 || fd<0 || ring_inflight==ring_entries) return false;
+
+    tail = *ring_sq.tail;
+    index = tail & *ring_sq.mask;
+    sqe = &(ring_sq.sqes[index]);
+    memset(sqe,0,sizeof(struct io_uring_sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->off = address;
+    sqe->addr = (uint64_t)(uintptr_t)ptr;
+    sqe->len = length;
+    sqe->user_data = (uint64_t)(uintptr_t)v;
+    ring_sq.array[index] = index;
+    __atomic_store_n(ring_sq.tail,tail+1,__ATOMIC_RELEASE);
+
+    ring_queued++;
+    ring_inflight++;
+    return true;
+}
+
+
+bool sys_uring_init(uint32_t entries)
+{
+    struct io_uring_params p;
+
+    if(ring_fd>=0) return true;
+
+    memset(&p,0,sizeof(p));
+    ring_fd = (int)syscall(__NR_io_uring_setup,entries,&p);
+    if(ring_fd<0){
+        printf("Error io_uring_setup\n");
+        return false;
+    }
+
+    // Map the submission ring, the completion ring and the entries
+    ring_sq_size = p.sq_off.array+(p.sq_entries*sizeof(unsigned));
+    ring_cq_size = p.cq_off.cqes+(p.cq_entries*sizeof(struct io_uring_cqe));
+    if(p.features & IORING_FEAT_SINGLE_MMAP){
+        if(ring_cq_size>ring_sq_size) ring_sq_size = ring_cq_size;
+        ring_cq_size = ring_sq_size;
+    }
+    ring_sq_map = mmap(NULL,ring_sq_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,ring_fd,IORING_OFF_SQ_RING);
+    if(ring_sq_map==MAP_FAILED){
+        ring_sq_map = NULL;
+        sys_uring_exit();
+        return false;
+    }
+    if(p.features & IORING_FEAT_SINGLE_MMAP){
+        ring_cq_map = ring_sq_map;
+    }else{
+        ring_cq_map = mmap(NULL,ring_cq_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,ring_fd,IORING_OFF_CQ_RING);
+        if(ring_cq_map==MAP_FAILED){
+            ring_cq_map = NULL;
+            sys_uring_exit();
+            return false;
+        }
+    }
+    ring_sqes_size = p.sq_entries*sizeof(struct io_uring_sqe);
+    ring_sq.sqes = mmap(NULL,ring_sqes_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,ring_fd,IORING_OFF_SQES);
+    if(ring_sq.sqes==MAP_FAILED){
+        ring_sq.sqes = NULL;
+        sys_uring_exit();
+        return false;
+    }
+
+    ring_sq.head = (unsigned*)((uint8_t*)ring_sq_map+p.sq_off.head);
+    ring_sq.tail = (unsigned*)((uint8_t*)ring_sq_map+p.sq_off.tail);
+    ring_sq.mask = (unsigned*)((uint8_t*)ring_sq_map+p.sq_off.ring_mask);
+    ring_sq.array = (unsigned*)((uint8_t*)ring_sq_map+p.sq_off.array);
+    ring_cq.head = (unsigned*)((uint8_t*)ring_cq_map+p.cq_off.head);
+    ring_cq.tail = (unsigned*)((uint8_t*)ring_cq_map+p.cq_off.tail);
+    ring_cq.mask = (unsigned*)((uint8_t*)ring_cq_map+p.cq_off.ring_mask);
+    ring_cq.cqes = (struct io_uring_cqe*)((uint8_t*)ring_cq_map+p.cq_off.cqes);
+    ring_entries = p.sq_entries;
+    ring_queued = 0;
+    ring_inflight = 0;
+
+    return true;
+}
+
+void sys_uring_exit()
+{
+    if(ring_sq.sqes) munmap(ring_sq.sqes,ring_sqes_size);
+    if(ring_cq_map && ring_cq_map!=ring_sq_map) munmap(ring_cq_map,ring_cq_size);
+    if(ring_sq_map) munmap(ring_sq_map,ring_sq_size);
+    if(ring_fd>=0) close(ring_fd);
+    ring_sq.sqes = NULL;
+    ring_sq_map = NULL;
+    ring_cq_map = NULL;
+    ring_fd = -1;
+    ring_queued = 0;
+    ring_inflight = 0;
+    return;
+}
+
+// Submit what was queued, reap finished transfers and pass each to the
+// volume that started it. With wait, blocks until one has finished unless
+// nothing is in flight. Returns how many finished.
+uint32_t sys_uring_poll(bool wait)
+{
+    unsigned head, tail;
+    uint32_t count = 0;
+    int n;
+    struct io_uring_cqe * cqe;
+
+    if(ring_fd<0) return 0;
+
+    while(1)
+    {
+        head = *ring_cq.head;
+        tail = __atomic_load_n(ring_cq.tail,__ATOMIC_ACQUIRE);
+        wait = wait && head==tail && ring_inflight>0;
+        if(ring_queued==0 && !wait) break;
+
+        // Every queued entry in one call, waiting in the same call
+        n = sys_uring_enter(ring_queued,wait?1:0);
+        if(n<0) return 0;
+        ring_queued -= (uint32_t)n;
+        if(!wait) break;
+    }
+
+    while(head!=tail)
+    {
+        cqe = &(ring_cq.cqes[head & *ring_cq.mask]);
+        utfs_vol_io_done((utfs_volume_t*)(uintptr_t)cqe->user_data,(cqe->res>0)?(uint32_t)cqe->res:0);
+        ring_inflight--;
+        count++;
+        head++;
+    }
+    __atomic_store_n(ring_cq.head,head,__ATOMIC_RELEASE);
+
+    return count;
+}
+
+bool sys_uring_read(utfs_volume_t * v, int fd, uint32_t size, uint32_t address, void * ptr, uint32_t length)
+{
+    // Stop at the end of the file, a read past it comes back short from
+    // the ring as it does from sys_read()
+    if(address>=size) length = 0;
+    else if(length>size-address) length = size-address;
+    return sys_uring_queue(IORING_OP_READ,v,fd,address,ptr,length);
+}
+
+bool sys_uring_write(utfs_volume_t * v, int fd, uint32_t address, void * ptr, uint32_t length)
+{
+    return sys_uring_queue(IORING_OP_WRITE,v,fd,address,ptr,length);
+}
+
+bool sys_read_async(uint32_t address, void * ptr, uint32_t length)
+{
+    return sys_uring_read(utfs_default_volume(),sys_fd(),sys_size(),address,ptr,length);
+}
+
+bool sys_write_async(uint32_t address, void * ptr, uint32_t length)
+{
+    return sys_uring_write(utfs_default_volume(),sys_write_fd(address,length),address,ptr,length);
+}
+
+#endif
+
+// EOF
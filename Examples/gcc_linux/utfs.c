@@ -20,46 +20,308 @@
 // ----------------------------------------------------------------------------
 #define UTFS_IDENTIFIER     0x1984
 #define UTFS_VERSION_V1     1
+#define UTFS_VERSION_V2     2   // Volume starts with a directory block
+#define UTFS_VERSION_LOG    3   // Log record, reserved holds a check of the data
+
+#if UTFS_HASH_BUCKETS<1 || (UTFS_HASH_BUCKETS&(UTFS_HASH_BUCKETS-1))!=0
+#error "UTFS_HASH_BUCKETS must be a power of 2"
+#endif
+#define UTFS_FNV_OFFSET     0x811C9DC5UL
+#define UTFS_FNV_PRIME      0x01000193UL
+
+// Load and save operations, see utfs_op_t
+#define UTFS_OP_NONE        0
+#define UTFS_OP_LOAD        1
+#define UTFS_OP_SAVE        2
+#define UTFS_PHASE_START    0   // Directory header, or the log's markers
+#define UTFS_PHASE_HEADER   1
+#define UTFS_PHASE_NEXT     2   // Load with UTFS_ENABLE_ASYNC, read the next header
+#define UTFS_PHASE_DATA     3
+#define UTFS_PHASE_END      4
+#define UTFS_PHASE_DIR      5   // Save with UTFS_ENABLE_DIRECTORY, the entries
+#define UTFS_PHASE_SCAN     6   // Log, walk the records of the live half
+
+// Transfer running for a step operation, see UTFS_ENABLE_ASYNC
+#define UTFS_IO_NONE        0
+#define UTFS_IO_HEADER      1
+#define UTFS_IO_DATA        2
+#define UTFS_IO_WRITE       3
+
+// utfs_file_t state bits
+#define UTFS_STATE_DIRTY    0x01
+#define UTFS_STATE_COPIED   0x02    // Copied by the running compaction
+#define UTFS_STATE_QUEUED   0x04    // Requested, see utfs_save_request()
+
+// gap_stored when the file was found through the directory
+#define UTFS_GAP_UNKNOWN    0xFFFF
+
+// utfs_file_t registered, mixed with the file's address so that a file that
+// was never set up can't pass for a registered one
+#define UTFS_REGISTERED_KEY 0x55544653UL
+#define _registered(f)      ((f)->registered==(UTFS_REGISTERED_KEY^(uint32_t)(uintptr_t)(f)))
+
+// utfs_volume_t set up by utfs_vol_init(), the same way. The default volume
+// is set up statically.
+#define UTFS_LIVE_KEY       0x55544656UL
+#define _live(v)            ((v)==&_volume || (v)->live==(UTFS_LIVE_KEY^(uint32_t)(uintptr_t)(v)))
+
+#ifdef UTFS_ENABLE_LOG_VOLUME
+#if defined(UTFS_ENABLE_DIRECTORY) || defined(UTFS_ENABLE_ALIGN)
+#error "UTFS_ENABLE_LOG_VOLUME can't be used with UTFS_ENABLE_DIRECTORY or UTFS_ENABLE_ALIGN"
+#endif
+#define UTFS_LOG_HALF       (UTFS_LOG_SIZE/2)
+#define UTFS_COMPACT_IDLE   0
+#define UTFS_COMPACT_ERASE  1
+#define UTFS_COMPACT_COPY   2
+#endif
+
+#if defined(UTFS_ENABLE_SNAPSHOT) && defined(UTFS_ENABLE_LOG_VOLUME)
+#error "UTFS_ENABLE_SNAPSHOT can't be used with UTFS_ENABLE_LOG_VOLUME"
+#endif
+
+#if defined(UTFS_ENABLE_QUEUE) && (UTFS_QUEUE_SIZE<2 || UTFS_QUEUE_SIZE>255)
+#error "UTFS_QUEUE_SIZE must be from 2 to 255"
+#endif
+#define UTFS_QUEUE_NEXT(I)  ((((I)+1)>=UTFS_QUEUE_SIZE)?0:((I)+1))
+
+#if defined(UTFS_ENABLE_MAPPED) && defined(UTFS_ENABLE_LOG_VOLUME)
+#error "UTFS_ENABLE_MAPPED can't be used with UTFS_ENABLE_LOG_VOLUME, compaction moves records"
+#endif
+
+#if defined(UTFS_ENABLE_ASYNC) && (defined(UTFS_ENABLE_CACHE) || defined(UTFS_ENABLE_LOG_VOLUME) || defined(UTFS_ENABLE_DIFF_WRITE))
+#error "UTFS_ENABLE_ASYNC can't be used with UTFS_ENABLE_CACHE, UTFS_ENABLE_LOG_VOLUME or UTFS_ENABLE_DIFF_WRITE"
+#endif
+
+#if defined(UTFS_ENABLE_ALIGN) && (UTFS_ALIGN_SIZE>32768 || (UTFS_ALIGN_SIZE&(UTFS_ALIGN_SIZE-1))!=0)
+#error "UTFS_ALIGN_SIZE must be a power of 2 up to 32768"
+#endif
+
+// With UTFS_ENABLE_VECTORED the save writes go through sys_writev(), _write()
+// and _medium_write() are only needed by the paths that write on their own
+#if !defined(UTFS_ENABLE_VECTORED) || defined(UTFS_ENABLE_DIFF_WRITE) || defined(UTFS_ENABLE_DIRECTORY) || defined(UTFS_ENABLE_LOG_VOLUME)
+#define UTFS_PLAIN_WRITE
+#endif
+
+#ifdef UTFS_ENABLE_CACHE
+#define UTFS_CACHE_PAGES    (UTFS_CACHE_ERASE_SIZE/UTFS_CACHE_PAGE_SIZE)
+#if (UTFS_CACHE_ERASE_SIZE%UTFS_CACHE_PAGE_SIZE)!=0 || UTFS_CACHE_PAGES>32
+#error "UTFS_CACHE_ERASE_SIZE must be 1 to 32 pages of UTFS_CACHE_PAGE_SIZE"
+#endif
+#endif
 
 
 // Types
 // ----------------------------------------------------------------------------
+#ifdef UTFS_ENABLE_DIRECTORY
+// V2 directory, written at the base address ahead of the file headers.
+// The first 4 bytes line up with utfs_header_t so either can be read first.
 typedef struct{
-    uint16_t ident;
+    uint16_t identifier;
     uint8_t version;
     uint8_t flags;
-    uint16_t signature;
-    uint16_t unused;
-    uint32_t size;
-    char filename[12];
-}utfs_header_t;
+    uint16_t count;
+    uint16_t reserved;
+    uint32_t size;          // Bytes from the base address to the first header
+}utfs_dir_header_t;
 
+typedef struct{
+    uint32_t hash;
+    uint32_t offset;        // Offset of the file data from the base address
+    uint32_t size;
+    uint16_t signature;
+    uint8_t flags;
+    uint8_t reserved;
+}utfs_dir_entry_t;
+#endif
 
-// Variables
-// ----------------------------------------------------------------------------
-static utfs_file_t * file_list[UTFS_MAX_FILES];
-static bool _structure_saved = false;
-static bool _utfs_verbose;
-static uint32_t _baseaddr;
 
 // System Prototypes
 // ----------------------------------------------------------------------------
 uint32_t sys_write(uint32_t address, void * ptr, uint32_t length);
 uint32_t sys_read(uint32_t address, void * ptr, uint32_t length);
+#ifdef UTFS_ENABLE_VECTORED
+uint32_t sys_writev(uint32_t address, utfs_iovec_t * iov, uint32_t count);
+uint32_t sys_readv(uint32_t address, utfs_iovec_t * iov, uint32_t count);
+#endif
+#ifdef UTFS_ENABLE_ASYNC
+bool sys_write_async(uint32_t address, void * ptr, uint32_t length);
+bool sys_read_async(uint32_t address, void * ptr, uint32_t length);
+static bool _sys_write_async(utfs_volume_t * v, uint32_t address, void * ptr, uint32_t length);
+static bool _sys_read_async(utfs_volume_t * v, uint32_t address, void * ptr, uint32_t length);
+#endif
+#ifdef UTFS_ENABLE_MAPPED
+void * sys_map(uint32_t address, uint32_t length);
+#endif
+#ifdef UTFS_ENABLE_COALESCE
+uint32_t sys_tick(void);
+#endif
+
+// Variables
+// ----------------------------------------------------------------------------
+// The volume behind the calls without a utfs_volume_t, on the sys_ functions
+static const utfs_port_t _sys_port = {
+    .write = sys_write,
+    .read = sys_read,
+#ifdef UTFS_ENABLE_VECTORED
+    .writev = sys_writev,
+    .readv = sys_readv,
+#endif
+#ifdef UTFS_ENABLE_ASYNC
+    .write_async = _sys_write_async,
+    .read_async = _sys_read_async,
+#endif
+#ifdef UTFS_ENABLE_MAPPED
+    .map = sys_map,
+#endif
+#ifdef UTFS_ENABLE_COALESCE
+    .tick = sys_tick,
+#endif
+};
+static utfs_volume_t _volume = {
+    .port = &_sys_port,
+    .hash_list = _volume.hash_table,
+    .hash_mask = UTFS_HASH_BUCKETS-1,
+#if UTFS_MAX_FILES>0
+    .file_list = _volume.table,
+    .file_capacity = UTFS_MAX_FILES,
+#endif
+#ifdef UTFS_ENABLE_LOCK
+    .lock = PTHREAD_RWLOCK_INITIALIZER,
+#endif
+#ifdef UTFS_ENABLE_COALESCE
+    .coalesce_quiet = UTFS_COALESCE_QUIET,
+    .coalesce_deadline = UTFS_COALESCE_DEADLINE,
+#endif
+};
 
 // Local Prototypes (Private)
 // ----------------------------------------------------------------------------
+#ifdef UTFS_PLAIN_WRITE
+static uint32_t _write(utfs_volume_t * v, uint32_t address, void * ptr, uint32_t length);
+#endif
+static uint32_t _medium_read(utfs_volume_t * v, uint32_t address, void * ptr, uint32_t length);
+#ifdef UTFS_PLAIN_WRITE
+static uint32_t _medium_write(utfs_volume_t * v, uint32_t address, void * ptr, uint32_t length);
+#endif
+static utfs_result_e _commit(utfs_volume_t * v, utfs_result_e res);
+#ifdef UTFS_ENABLE_CACHE
+static utfs_cache_line_t * _cache_find(utfs_volume_t * v, uint32_t block);
+static utfs_cache_line_t * _cache_line(utfs_volume_t * v, uint32_t block);
+static utfs_result_e _cache_line_flush(utfs_volume_t * v, utfs_cache_line_t * line);
+#endif
+#ifdef UTFS_ENABLE_DIFF_WRITE
+static uint32_t _write_run(utfs_volume_t * v, uint32_t address, uint8_t * data, uint32_t length);
+#endif
 static void _print_header(utfs_header_t * header);
+static uint32_t _filename_hash(const char * name);
+#if defined(UTFS_DATA_HASH) || defined(UTFS_ENABLE_LOG_VOLUME)
+static uint32_t _data_hash(uint32_t hash, void * data, uint32_t size);
+#endif
+static utfs_file_t * _file_find(utfs_volume_t * v, const char * name, uint32_t hash);
+static void _hash_insert(utfs_volume_t * v, utfs_file_t * f);
+static void _hash_remove(utfs_volume_t * v, utfs_file_t * f);
+static void _header_fill(utfs_header_t * header, utfs_file_t * f, uint16_t gap);
+static uint16_t _align_gap(uint32_t address);
+static uint16_t _file_gap(utfs_volume_t * v, utfs_file_t * f, uint32_t offset);
+static bool _file_fits(utfs_file_t * f);
+#ifdef UTFS_ENABLE_MAPPED
+static void _file_map(utfs_volume_t * v, utfs_file_t * f);
+#endif
+static utfs_result_e _layout_check(utfs_volume_t * v);
+static uint32_t _region_clip(utfs_volume_t * v, uint32_t address, uint32_t length);
+static bool _header_valid(utfs_header_t * header);
+static bool _header_read(utfs_volume_t * v, uint32_t address, utfs_header_t * header);
+static utfs_result_e _batch_write(utfs_volume_t * v, utfs_batch_t * b, uint32_t address, void * ptr, uint32_t length);
+static utfs_result_e _batch_flush(utfs_volume_t * v, utfs_batch_t * b);
+static void _file_resolved(utfs_file_t * f, uint32_t offset, uint32_t size, uint16_t signature, uint8_t flags, uint16_t gap);
+static void _file_forget(utfs_volume_t * v);
+static void _vol_release(utfs_volume_t * v);
+static utfs_result_e _file_read(utfs_volume_t * v, utfs_file_t * f);
+static void _file_loaded(utfs_file_t * f, uint32_t s);
+static void _file_clean(utfs_file_t * f);
+#ifdef UTFS_ENABLE_INCREMENTAL
+static bool _file_changed(utfs_file_t * f);
+#endif
+static utfs_result_e _op_begin(utfs_volume_t * v, uint8_t op, bool flush, bool commit);
+static utfs_result_e _op_end(utfs_volume_t * v, utfs_result_e res);
+static utfs_result_e _load_all(utfs_volume_t * v);
+static utfs_result_e _save_all(utfs_volume_t * v, bool flush);
+static utfs_result_e _save(utfs_volume_t * v, bool flush);
+#ifdef UTFS_ENABLE_QUEUE
+static void _queue_drain(utfs_volume_t * v);
+static utfs_result_e _queue_save(utfs_volume_t * v);
+#endif
+#if defined(UTFS_ENABLE_QUEUE) || defined(UTFS_ENABLE_COALESCE)
+static utfs_result_e _service(utfs_volume_t * v, bool now);
+#endif
+#ifdef UTFS_ENABLE_COALESCE
+static void _coalesce_pend(utfs_volume_t * v);
+static bool _coalesce_due(utfs_volume_t * v);
+#endif
+static utfs_result_e _load_file(utfs_volume_t * v, utfs_file_t * f);
+static utfs_result_e _save_file(utfs_volume_t * v, utfs_file_t * f);
+static void _lock(utfs_volume_t * v);
+static void _lock_shared(utfs_volume_t * v);
+static utfs_result_e _unlock(utfs_volume_t * v, utfs_result_e res);
+static void _file_lock(utfs_file_t * f);
+static void _file_unlock(utfs_file_t * f);
+static void _snap_begin(utfs_volume_t * v);
+static utfs_result_e _snap_end(utfs_volume_t * v, utfs_result_e res);
+static void _snap_touch(utfs_volume_t * v, uint32_t address, uint32_t length);
+static void _snap_file_begin(utfs_file_t * f);
+static utfs_result_e _snap_file_end(utfs_volume_t * v, utfs_file_t * f, utfs_result_e res);
+static utfs_result_e _snap_file(utfs_volume_t * v, utfs_file_t * f, utfs_result_e res);
+#ifdef UTFS_ENABLE_SNAPSHOT
+static bool _snap_overlaps(utfs_volume_t * v, uint32_t address, uint32_t length);
+#endif
+#ifdef UTFS_ENABLE_LOCK
+static bool _file_in_place(utfs_file_t * f, bool save);
+static bool _file_shared(utfs_volume_t * v, utfs_file_t * f, bool save, utfs_result_e * res);
+#endif
+static utfs_result_e _load_run(utfs_volume_t * v, uint32_t budget);
+static utfs_result_e _save_run(utfs_volume_t * v, uint32_t budget);
+static void _load_parse(utfs_volume_t * v, utfs_header_t * header);
+static uint32_t _load_read(utfs_volume_t * v, uint32_t address, void * ptr, uint32_t length);
+static utfs_result_e _save_write(utfs_volume_t * v, uint32_t address, void * ptr, uint32_t length);
+#ifdef UTFS_ENABLE_ASYNC
+static utfs_result_e _io_submit(utfs_volume_t * v, uint8_t io, uint32_t address, void * ptr, uint32_t length);
+static utfs_result_e _load_done(utfs_volume_t * v);
+static utfs_result_e _load_async(utfs_volume_t * v);
+#endif
+#ifdef UTFS_ENABLE_LOG_VOLUME
+static uint32_t _log_start(utfs_volume_t * v, uint32_t half);
+static bool _log_is_marker(utfs_header_t * header);
+static uint16_t _log_check(uint32_t hash);
+static utfs_result_e _log_find(utfs_volume_t * v);
+static utfs_result_e _log_mount(utfs_volume_t * v);
+static void _log_scan(utfs_volume_t * v, uint32_t start, uint32_t end);
+static void _log_scan_begin(utfs_volume_t * v, utfs_log_scan_t * s, uint32_t start, uint32_t end);
+static utfs_result_e _log_scan_run(utfs_volume_t * v, utfs_log_scan_t * s, uint32_t budget, uint32_t * used);
+static utfs_result_e _log_marker(utfs_volume_t * v, uint32_t half, uint16_t epoch);
+static utfs_result_e _log_load_run(utfs_volume_t * v, uint32_t budget);
+static utfs_result_e _log_save(utfs_volume_t * v, bool flush, utfs_file_t * only);
+static utfs_result_e _log_save_run(utfs_volume_t * v, uint32_t budget);
+static void _log_compact_begin(utfs_volume_t * v);
+static utfs_result_e _log_step(utfs_volume_t * v);
+#endif
+#ifdef UTFS_ENABLE_DIRECTORY
+static uint32_t _dir_size(utfs_volume_t * v);
+static utfs_result_e _dir_begin(utfs_volume_t * v);
+static utfs_result_e _dir_chunk(utfs_volume_t * v, uint32_t * written);
+static utfs_result_e _dir_check(utfs_volume_t * v);
+static utfs_result_e _dir_find(utfs_volume_t * v, utfs_file_t * f, utfs_dir_entry_t * entry, uint32_t * index);
+#endif
 
-// Logging
+// Logging, to the volume 'v' of the calling function
 #if defined(UTFS_ENABLE_LOG_PRINTF)
-#define _utfs_log(...)        do{ if(_utfs_verbose){ printf(__VA_ARGS__); } }while(0)
+#define _utfs_log(...)        do{ if(v->verbose){ printf(__VA_ARGS__); } }while(0)
 #elif defined(UTFS_ENABLE_LOG_VPRINTF)
 #include <stdarg.h>
-static inline void _utfs_log(const char *fmt, ...)
+#define _utfs_log(...)        _utfs_vlog(v->verbose,__VA_ARGS__)
+static inline void _utfs_vlog(bool verbose, const char *fmt, ...)
 {
 	va_list ap;
-    if(!_utfs_verbose) return;
+    if(!verbose) return;
 	va_start(ap, fmt);
     vprintf(fmt, ap);
 	va_end(ap);
@@ -71,399 +333,480 @@ static inline void _utfs_log(const char *fmt, ...)
 
 // Public functions
 // ----------------------------------------------------------------------------
-utfs_result_e utfs_init(bool verbose)
+utfs_result_e utfs_vol_init(utfs_volume_t * v, const utfs_port_t * port, bool verbose)
+{
+#if UTFS_MAX_FILES>0
+    if(!v) return RES_PARAM_ERROR;
+    return utfs_vol_init_table(v,port,verbose,v->table,UTFS_MAX_FILES);
+#else
+    return utfs_vol_init_table(v,port,verbose,NULL,0);
+#endif
+}
+
+utfs_result_e utfs_vol_init_table(utfs_volume_t * v, const utfs_port_t * port, bool verbose, utfs_file_t ** table, uint32_t capacity)
 {
-    memset(file_list,0,sizeof(file_list));
-    _structure_saved=false;
-    _utfs_verbose=verbose;
-    _baseaddr=0;
-    _utfs_log("_utfs_verbose: %d\n",_utfs_verbose);
+    if(!v || !port || !port->read || !port->write) return RES_PARAM_ERROR;
+#ifdef UTFS_ENABLE_VECTORED
+    if(!port->writev || !port->readv) return RES_PARAM_ERROR;
+#endif
+#ifdef UTFS_ENABLE_ASYNC
+    if(!port->write_async || !port->read_async) return RES_PARAM_ERROR;
+#endif
+#ifdef UTFS_ENABLE_MAPPED
+    if(!port->map) return RES_PARAM_ERROR;
+#endif
+#ifdef UTFS_ENABLE_COALESCE
+    if(!port->tick) return RES_PARAM_ERROR;
+#endif
+    if(!table && capacity>0) return RES_PARAM_ERROR;
+
+    // Set up before, let go of its files and locks
+    if(_live(v)) _vol_release(v);
+
+    // Everything else starts out zero, no files and nothing running
+    memset(v,0,sizeof(utfs_volume_t));
+    v->live = UTFS_LIVE_KEY^(uint32_t)(uintptr_t)v;
+    v->port = port;
+    v->file_list = table;
+    v->file_capacity = capacity;
+    if(v->file_list) memset(v->file_list,0,capacity*sizeof(utfs_file_t *));
+    v->hash_list = v->hash_table;
+    v->hash_mask = UTFS_HASH_BUCKETS-1;
+    v->verbose=verbose;
+#ifdef UTFS_ENABLE_LOCK
+    pthread_rwlock_init(&v->lock,NULL);
+#endif
+#ifdef UTFS_ENABLE_COALESCE
+    v->coalesce_quiet = UTFS_COALESCE_QUIET;
+    v->coalesce_deadline = UTFS_COALESCE_DEADLINE;
+#endif
+    _utfs_log("verbose: %d\n",v->verbose);
     _utfs_log("utfs_file_t size: %ld bytes\n",sizeof(utfs_file_t));
     return RES_OK;
 }
 
-utfs_result_e utfs_baseaddress_set(uint32_t baseaddr)
+utfs_result_e utfs_vol_baseaddress_set(utfs_volume_t * v, uint32_t baseaddr)
 {
-    _baseaddr = baseaddr;
-    return RES_OK;
+    _lock(v);
+    if(v->op.op!=UTFS_OP_NONE) return _unlock(v,RES_BUSY);
+    v->baseaddr = baseaddr;
+    _file_forget(v);
+    v->scratch_len = 0;
+#ifdef UTFS_ENABLE_DIRECTORY
+    v->dir_checked=false;
+#endif
+#ifdef UTFS_ENABLE_LOG_VOLUME
+    v->log_mounted=false;
+#endif
+    return _unlock(v,_snap_end(v,RES_OK));
 }
 
-utfs_result_e utfs_register(utfs_file_t * f, utfs_flags_e flags, utfs_options_e options)
+utfs_result_e utfs_vol_size_set(utfs_volume_t * v, uint32_t size)
 {
-    int x;
-    if(!f) return RES_PARAM_ERROR;
-    f->flags = flags;
-    for(x=0;x<UTFS_MAX_FILES;x++)
-    {
-        if(file_list[x]==NULL)
-        {
-            _utfs_log("Found empty slot %d\n",x);
-            file_list[x] = f;
-            return RES_OK;
-        }else if(strncmp(file_list[x]->filename,f->filename,UTFS_MAX_FILENAME+1)==0){
-            if((options&UTFS_OPT_REPLACE)==UTFS_OPT_REPLACE)
-            {
-                _utfs_log("Found %s=%s, replacing\n",file_list[x]->filename,f->filename);
-                file_list[x] = f;
-                return RES_OK;
-            }else{
-                _utfs_log("Found %s, NOT overwriting\n",f->filename);
-                return RES_FILENAME_EXISTS;
-            }
-        }
-    }
-    if(x==UTFS_MAX_FILES){
-        _utfs_log("Could not find slot");
-        return RES_FILESYSTEM_FULL;
-    }
-    return RES_OK;
+#ifdef UTFS_ENABLE_LOG_VOLUME
+    // The log region is fixed, it has to fit
+    if(size!=0 && size<UTFS_LOG_SIZE) return RES_PARAM_ERROR;
+#endif
+    _lock(v);
+    if(v->op.op!=UTFS_OP_NONE) return _unlock(v,RES_BUSY);
+    v->size = size;
+    return _unlock(v,RES_OK);
 }
 
-utfs_result_e utfs_unregister(utfs_file_t * f)
+utfs_result_e utfs_vol_scratch_set(utfs_volume_t * v, void * buffer, uint32_t size)
 {
-    int x;
-    if(!f) return RES_PARAM_ERROR;
-    for(x=0;x<UTFS_MAX_FILES;x++)
+    if(!buffer && size>0) return RES_PARAM_ERROR;
+    _lock(v);
+    if(v->op.op!=UTFS_OP_NONE) return _unlock(v,RES_BUSY);
+    v->scratch = (uint8_t*)buffer;
+    v->scratch_size = buffer ? size : 0;
+    v->scratch_len = 0;
+    return _unlock(v,RES_OK);
+}
+
+utfs_result_e utfs_vol_hash_set(utfs_volume_t * v, utfs_file_t ** buckets, uint32_t count)
+{
+    uint32_t x;
+
+    if(buckets && (count==0 || (count&(count-1))!=0)) return RES_PARAM_ERROR;
+    _lock(v);
+    if(v->op.op!=UTFS_OP_NONE) return _unlock(v,RES_BUSY);
+    if(buckets)
     {
-        if(file_list[x]==f){
-            _utfs_log("Removed %s at position %d\n",file_list[x]->filename,x);
-            file_list[x] = NULL;
-            return RES_OK;
-        }
+        v->hash_list = buckets;
+        v->hash_mask = count-1;
+    }else{
+        v->hash_list = v->hash_table;
+        v->hash_mask = UTFS_HASH_BUCKETS-1;
     }
-    return RES_FILE_NOT_FOUND;
+
+    // File the registered files again under the new mask
+    memset(v->hash_list,0,(v->hash_mask+1)*sizeof(utfs_file_t *));
+    for(x=0;x<v->file_count;x++) _hash_insert(v,v->file_list[x]);
+    return _unlock(v,RES_OK);
 }
 
-utfs_result_e utfs_load()
+utfs_result_e utfs_vol_register(utfs_volume_t * v, utfs_file_t * f, utfs_flags_e flags, utfs_options_e options)
 {
-    uint32_t x,f;
-    uint32_t pos;
-    utfs_header_t header;
-    
-    memset(&header,0,sizeof(header));
+    uint32_t x;
+    utfs_file_t * existing;
+    if(!f) return RES_PARAM_ERROR;
+    _lock(v);
+    if(v->op.op!=UTFS_OP_NONE) return _unlock(v,RES_BUSY);
+    f->flags = flags;
 
-    pos = _baseaddr;
+    // Hash the name once, all lookups after this use the hash
+    f->hash = _filename_hash(f->filename);
+    f->offset = 0;
+    f->state = 0;
+#ifdef UTFS_ENABLE_SNAPSHOT
+    f->snap_seq = 0;
+    __atomic_store_n(&f->snap_offset,0,__ATOMIC_RELAXED);
+#endif
+#ifdef UTFS_ENABLE_LOG_VOLUME
+    v->log_mounted = false;   // Scan again to find the new file
+#endif
 
-    // Read up to UTFS_MAX_FILES files
-    for(x=0;x<UTFS_MAX_FILES;x++)
+    existing = _file_find(v,f->filename,f->hash);
+#ifdef UTFS_ENABLE_DIRECTORY
     {
-        // Read the header
-        f = sys_read(pos, (uint8_t*)&header, sizeof(header));
-        if(f<=0 || header.ident != UTFS_IDENTIFIER || header.version != UTFS_VERSION_V1)
+        utfs_file_t * h;
+        // The directory identifies files by hash, so two names can't share one
+        for(h=v->hash_list[f->hash&v->hash_mask];h!=NULL;h=h->next)
         {
-            break;
+            if(h!=existing && h->hash==f->hash){
+                _utfs_log("Hash of %s collides with %s\n",f->filename,h->filename);
+                return _unlock(v,RES_FILENAME_EXISTS);
+            }
         }
-        if(_utfs_verbose) _print_header(&header);
-        pos += sizeof(header);
-        
-        // Find the file
-        for(f=0;f<UTFS_MAX_FILES;f++)
+    }
+#endif
+    if(existing)
+    {
+        if((options&UTFS_OPT_REPLACE)!=UTFS_OPT_REPLACE)
         {
-            if(file_list[f]==NULL) continue;
-            
-            if(strncmp(file_list[f]->filename,header.filename,UTFS_MAX_FILENAME+1)==0)
-            {
-                _utfs_log("Found match, position %d\n",f);
-                break;
-            }
-        
+            _utfs_log("Found %s, NOT overwriting\n",f->filename);
+            return _unlock(v,RES_FILENAME_EXISTS);
         }
-        
-        // Handle data
-        if(f>=UTFS_MAX_FILES)
+        for(x=0;x<v->file_count;x++)
         {
-            _utfs_log("Did not find file %s\n",header.filename);
-
-        }else if(file_list[f]->data==NULL){
-            _utfs_log("Null data, skipping\n");            
-            file_list[f]->size_loaded=0;
-            file_list[f]->signature=header.signature;
-            file_list[f]->flags&=(0xFF00); // blank the lower byte
-            file_list[f]->flags|=header.flags; // Add in the lower byte flags from the header
-            
-        }else{
-            uint32_t s;
-            
-            // Found the file, read in the data
-            
-            // The file is saved with a size, but if this application
-            // has a smaller buffer, only read in that much
-            s = header.size;
-            if(s>file_list[f]->size) s=file_list[f]->size;
-            
-            // Read in the data
-            #ifdef UTFS_ENABLE_FLAGS
-            if((file_list[f]->flags&LOAD_EXPLICIT)==0)
-            #else
-            if(true)
-            #endif
+            if(v->file_list[x]==existing)
             {
-                sys_read(pos, file_list[f]->data, s);
-                file_list[f]->size_loaded=s;
-                file_list[f]->signature=header.signature;
-                file_list[f]->flags&=(0xFF00); // blank the lower byte
-                file_list[f]->flags|=header.flags; // Add in the lower byte flags from the header
-            }else{
-                _utfs_log("LOAD_EXPLICIT set, skipping read '%s'\n",header.filename);
-                file_list[f]->size_loaded=0;
-                file_list[f]->signature=0;
-                file_list[f]->flags&=(0xFF00); // blank the lower byte
+                _utfs_log("Found %s=%s, replacing\n",existing->filename,f->filename);
+                _hash_remove(v,existing);
+#ifdef UTFS_ENABLE_LOCK
+                if(existing!=f)
+                {
+                    pthread_mutex_destroy(&existing->lock);
+                    pthread_mutex_init(&f->lock,NULL);
+                }
+#endif
+                existing->registered = 0;
+                v->file_list[x] = f;
+                _hash_insert(v,f);
+                f->registered = UTFS_REGISTERED_KEY^(uint32_t)(uintptr_t)f;
+                f->volume = v;
+                return _unlock(v,RES_OK);
             }
-            
         }
-        pos += header.size;
     }
-    
-    // If we didn't load anything
-    if(x==0)
+
+    if(v->file_count>=v->file_capacity)
     {
-        _utfs_log("Error loading FS\n");
-        return RES_INVALID_FS;
+        _utfs_log("Could not find slot");
+        return _unlock(v,RES_FILESYSTEM_FULL);
     }
-    
-    return RES_OK;
+
+    _utfs_log("Using slot %d\n",v->file_count);
+    v->file_list[v->file_count++] = f;
+    _hash_insert(v,f);
+    f->registered = UTFS_REGISTERED_KEY^(uint32_t)(uintptr_t)f;
+    f->volume = v;
+#ifdef UTFS_ENABLE_LOCK
+    pthread_mutex_init(&f->lock,NULL);
+#endif
+    return _unlock(v,RES_OK);
 }
 
-utfs_result_e utfs_save()
+utfs_result_e utfs_vol_unregister(utfs_volume_t * v, utfs_file_t * f)
 {
-    uint8_t * bptr;
     uint32_t x;
-    uint32_t pos;
-    uint32_t written;
-    utfs_header_t header;
-    
-    pos = _baseaddr;
-    
-    // Write all the files
-    for(x=0;x<UTFS_MAX_FILES;x++)
-    {
-        if(file_list[x]!=NULL)
-        {
-            _utfs_log("Writing file %d at pos %d\n",x,pos);
-            memset(&header,0,sizeof(header));
-            header.ident = UTFS_IDENTIFIER;
-            header.version = UTFS_VERSION_V1;
-            header.flags = ((file_list[x]->flags)&0x00FF);   // Save the lower byte of the flags
-            header.signature = file_list[x]->signature;
-            header.unused = 0;
-            header.size = file_list[x]->size;
-            strncpy((char*)(header.filename),file_list[x]->filename,UTFS_MAX_FILENAME);
-            
-            bptr = (uint8_t*)(file_list[x]->data);
-            
-            // Write header
-            written = sys_write(pos,&header,sizeof(header));
-            if(written != sizeof(header))
-            {
-                _utfs_log("Error writing header, fs full\n");
-                return RES_FILESYSTEM_FULL;
-            }
-            pos += written;
-                
-            // Write data
-            #ifdef UTFS_ENABLE_FLAGS
-            if((file_list[x]->flags&SAVE_EXPLICIT)==0)
-            #else
-            if(true)
-            #endif
-            {
-                written = sys_write(pos,bptr,file_list[x]->size);
-                if(written != file_list[x]->size)
-                {
-                    _utfs_log("Error saving %u!=%u\n",written,file_list[x]->size);
-                    return RES_FILESYSTEM_FULL;
-                }
-            }else{
-                _utfs_log("SAVE_EXPLICIT set, not writing '%s'\n",header.filename);
-            }
-            
-            // Increment by size
-            pos += file_list[x]->size;
+    if(!f) return RES_PARAM_ERROR;
+    _lock(v);
+    if(v->op.op!=UTFS_OP_NONE) return _unlock(v,RES_BUSY);
+    for(x=0;x<v->file_count;x++)
+    {
+        if(v->file_list[x]==f){
+            _utfs_log("Removed %s at position %d\n",v->file_list[x]->filename,x);
+            _hash_remove(v,f);
+            f->registered = 0;
+#ifdef UTFS_ENABLE_LOCK
+            pthread_mutex_destroy(&f->lock);
+#endif
+#ifdef UTFS_ENABLE_SNAPSHOT
+            __atomic_store_n(&f->snap_offset,0,__ATOMIC_RELAXED);
+#endif
+
+            // Keep the list packed and in registration order
+            v->file_count--;
+            memmove(&(v->file_list[x]),&(v->file_list[x+1]),(v->file_count-x)*sizeof(utfs_file_t *));
+            v->file_list[v->file_count] = NULL;
+            return _unlock(v,RES_OK);
         }
     }
-    
-    // This means we have saved the structure
-    _structure_saved=true;
 
-    return RES_OK;
+    // Marked for this volume but not in its list, a volume set up over one
+    // that was never initialised again. Let the file be renamed.
+    if(_registered(f) && f->volume==v) f->registered = 0;
+    return _unlock(v,RES_FILE_NOT_FOUND);
 }
 
-utfs_result_e utfs_save_flush()
+utfs_result_e utfs_vol_load(utfs_volume_t * v)
 {
-    uint8_t * bptr;
-    uint32_t x;
-    uint32_t pos;
-    uint32_t written;
-    utfs_header_t header;
-    
-    pos = _baseaddr;
-    
-    // Write all the files
-    for(x=0;x<UTFS_MAX_FILES;x++)
-    {
-        if(file_list[x]!=NULL)
-        {
-            _utfs_log("Writing file %d at pos %d\n",x,pos);
-            memset(&header,0,sizeof(header));
-            header.ident = UTFS_IDENTIFIER;
-            header.version = UTFS_VERSION_V1;
-            header.flags = ((file_list[x]->flags)&0x00FF);   // Save the lower byte of the flags
-            header.signature = file_list[x]->signature;
-            header.unused = 0;
-            header.size = file_list[x]->size;
-            strncpy((char*)(header.filename),file_list[x]->filename,UTFS_MAX_FILENAME);
-            
-            bptr = (uint8_t*)(file_list[x]->data);
-            
-            // Write header
-            written = sys_write(pos,&header,sizeof(header));
-            if(written!=sizeof(header))
-            {
-                _utfs_log("Error writing header, fs full\n");
-                return RES_FILESYSTEM_FULL;
-            }
-            pos += written;
+    _lock(v);
+    return _unlock(v,_snap_end(v,_load_all(v)));
+}
 
-            // Write data
-            written = sys_write(pos,bptr,file_list[x]->size);
-            if(written!=file_list[x]->size)
-            {
-                _utfs_log("Error writing data, fs full\n");
-                return RES_FILESYSTEM_FULL;
-            }
-            
-            // Increment by size
-            pos += file_list[x]->size;
-        }
+utfs_result_e utfs_vol_save(utfs_volume_t * v)
+{
+    _lock(v);
+#ifdef UTFS_ENABLE_COALESCE
+    // Written by utfs_vol_service() when the requests stop
+    if(v->coalesce_quiet>0)
+    {
+        _coalesce_pend(v);
+        return _unlock(v,RES_OK);
     }
-    
-    // This means we have saved the structure
-    _structure_saved=true;
+#endif
+    if(v->op.op!=UTFS_OP_NONE) return _unlock(v,RES_BUSY);
+    return _unlock(v,_save(v,false));
+}
 
-    return RES_OK;
+utfs_result_e utfs_vol_save_flush(utfs_volume_t * v)
+{
+    _lock(v);
+    if(v->op.op!=UTFS_OP_NONE) return _unlock(v,RES_BUSY);
+    return _unlock(v,_save(v,true));
 }
 
-utfs_result_e utfs_load_file(utfs_file_t * f)
+utfs_result_e utfs_vol_load_step(utfs_volume_t * v)
 {
-    uint32_t x,i,s;
-    uint32_t pos;
-    utfs_header_t header;
-    
-    if(!f) return RES_PARAM_ERROR;
+    _lock(v);
+    if(v->op.op==UTFS_OP_NONE) _op_begin(v,UTFS_OP_LOAD,false,true);
+    if(v->op.op!=UTFS_OP_LOAD) return _unlock(v,RES_BUSY);
+#ifdef UTFS_ENABLE_ASYNC
+    return _unlock(v,_snap_end(v,_load_async(v)));
+#else
+    return _unlock(v,_snap_end(v,_load_run(v,UTFS_STEP_SIZE)));
+#endif
+}
 
-    pos = _baseaddr;
+utfs_result_e utfs_vol_save_step(utfs_volume_t * v)
+{
+    utfs_result_e res;
 
-    // Support up to UTFS_MAX_FILES files
-    for(x=0;x<UTFS_MAX_FILES;x++)
+    _lock(v);
+    if(v->op.op==UTFS_OP_NONE)
     {
-        // Read the header
-        i = sys_read(pos, (uint8_t*)&header, sizeof(header));
-        if(i<=0 || header.ident != UTFS_IDENTIFIER || header.version != UTFS_VERSION_V1)
-        {
-            return RES_FILE_NOT_FOUND;
-        }
-        pos += sizeof(header);
-        
-        // is it a match?
-        if(file_list[x]==NULL || strncmp(f->filename,file_list[x]->filename,UTFS_MAX_FILENAME+1)!=0)
-        {
-            // No, just skip the data
-            pos += header.size;
-            continue;
-        }
-
-        // It is a match
-        _utfs_log("Found file to load, pos %d\n",pos);
-        if(_utfs_verbose) _print_header(&header);
-        
-        // Handle null
-        if(file_list[x]->data==NULL){
-            _utfs_log("Null data, skipping\n");
-            return RES_OK;
-        }
-        
-        // Copy it over
-        
-        // The file is saved with a size, but if this application
-        // has a smaller buffer, only read in that much
-        s = header.size;
-        if(s>file_list[x]->size) s=file_list[x]->size;
-        
-        // Read in the data
-        sys_read(pos, file_list[x]->data, s);
-        file_list[x]->size_loaded=s;
-        file_list[x]->signature=header.signature;
-        file_list[x]->flags&=(0xFF00); // blank the lower byte
-        file_list[x]->flags|=header.flags; // Add in the lower byte flags from the header
-                        
-        // Good
-        return RES_OK;
+        _op_begin(v,UTFS_OP_SAVE,false,true);
+        _snap_begin(v);
+#ifdef UTFS_ENABLE_ASYNC
+        v->op.async = true;
+#endif
+#ifdef UTFS_ENABLE_COALESCE
+        // This writes what a pending utfs_save() asked for, saves asked
+        // for meanwhile stay pending
+        v->op.pending = v->save_pending;
+        v->save_pending = false;
+#endif
     }
-    
-    return RES_FILE_NOT_FOUND;
+    if(v->op.op!=UTFS_OP_SAVE) return _unlock(v,RES_BUSY);
+#ifdef UTFS_ENABLE_ASYNC
+    // One transfer per call, of any size
+    res = _snap_end(v,_save_run(v,0));
+#else
+    res = _snap_end(v,_save_run(v,UTFS_STEP_SIZE));
+#endif
+#ifdef UTFS_ENABLE_COALESCE
+    if(res!=RES_OK && res!=RES_BUSY && v->op.pending) _coalesce_pend(v);
+#endif
+    return _unlock(v,res);
 }
 
-utfs_result_e utfs_save_file(utfs_file_t * f)
+#ifdef UTFS_ENABLE_ASYNC
+void utfs_vol_io_done(utfs_volume_t * v, uint32_t length)
 {
-    uint8_t * bptr;
-    uint32_t x;
-    uint32_t pos;
-    utfs_header_t header;
-    
-    if(!f) return RES_PARAM_ERROR;
-    
-    // We can't save an individual file until the full set of files
-    // have been written, so write them first
-    if(_structure_saved==false){
-        // Save the structure, fails if it overflows
-        // the medium; aka fs full
-        if(utfs_save()!=RES_OK)
-        {
-            _utfs_log("Fatal error, fs full\n");
-            return RES_FILESYSTEM_FULL;
-        }
+    v->io_length = length;
+    v->io_pending = false;
+}
+#endif
+
+utfs_result_e utfs_vol_progress(utfs_volume_t * v, uint32_t * done, uint32_t * total)
+{
+    _lock_shared(v);
+    if(done) *done = (v->op.op==UTFS_OP_LOAD)?v->op.loaded:v->op.index;
+    if(total) *total = v->file_count;
+    if(v->op.op!=UTFS_OP_NONE) return _unlock(v,RES_BUSY);
+    return _unlock(v,RES_OK);
+}
+
+utfs_result_e utfs_vol_load_file(utfs_volume_t * v, utfs_file_t * f)
+{
+    utfs_result_e res;
+
+    if(!f) return RES_PARAM_ERROR;
+#ifdef UTFS_ENABLE_LOCK
+    if(_file_shared(v,f,false,&res)) return res;
+#endif
+    _lock(v);
+    res = _load_file(v,f);
+    return _unlock(v,res);
+}
+
+utfs_result_e utfs_vol_save_file(utfs_volume_t * v, utfs_file_t * f)
+{
+    utfs_result_e res;
+
+    if(!f) return RES_PARAM_ERROR;
+#ifdef UTFS_ENABLE_LOCK
+    if(_file_shared(v,f,true,&res)) return res;
+#endif
+    _lock(v);
+    res = _save_file(v,f);
+    return _unlock(v,res);
+}
+
+utfs_result_e utfs_vol_compact_step(utfs_volume_t * v)
+{
+#ifdef UTFS_ENABLE_LOG_VOLUME
+    _lock(v);
+    if(v->op.op!=UTFS_OP_NONE) return _unlock(v,RES_BUSY);
+    if(!v->log_mounted || v->log_compact==UTFS_COMPACT_IDLE) return _unlock(v,RES_OK);
+    return _unlock(v,_commit(v,_log_step(v)));
+#else
+    return RES_OK;
+#endif
+}
+
+utfs_result_e utfs_vol_load_stats(utfs_volume_t * v, uint32_t * unmatched, uint32_t * missing)
+{
+    _lock_shared(v);
+    if(unmatched) *unmatched = v->load_unmatched;
+    if(missing) *missing = v->load_missing;
+    return _unlock(v,RES_OK);
+}
+
+utfs_result_e utfs_vol_mark_dirty(utfs_volume_t * v, utfs_file_t * f)
+{
+    utfs_file_t * entry;
+    if(!f) return RES_PARAM_ERROR;
+    _lock_shared(v);
+    entry = _file_find(v,f->filename,_filename_hash(f->filename));
+    if(!entry) return _unlock(v,RES_FILE_NOT_FOUND);
+    _file_lock(entry);
+    entry->state |= UTFS_STATE_DIRTY;
+    _file_unlock(entry);
+    return _unlock(v,RES_OK);
+}
+
+#ifdef UTFS_ENABLE_SNAPSHOT
+utfs_result_e utfs_vol_snapshot_read(utfs_volume_t * v, utfs_file_t * f, void * buffer, uint32_t size, uint32_t * length)
+{
+    uint32_t x,vseq,fseq;
+    uint32_t address,offset,n;
+    bool saving;
+
+    if(!f || (!buffer && size>0)) return RES_PARAM_ERROR;
+
+    // A seqlock on the volume and one on the file, the read is started
+    // again if a save begins or ends while it runs
+    for(x=0;x<UTFS_SNAPSHOT_TRIES;x++)
+    {
+        vseq = __atomic_load_n(&v->snap_seq,__ATOMIC_ACQUIRE);
+        fseq = __atomic_load_n(&f->snap_seq,__ATOMIC_ACQUIRE);
+        if(fseq&1) return RES_BUSY;
+        offset = __atomic_load_n(&f->snap_offset,__ATOMIC_RELAXED);
+        n = __atomic_load_n(&f->snap_size,__ATOMIC_RELAXED);
+        if(n>size) n = size;
+        address = v->baseaddr+offset;
+
+        // While a save runs, what it has not written yet is still the
+        // image from before it
+        saving = (vseq&1)!=0;
+        if(offset!=0 && !(saving && _snap_overlaps(v,address,n)) &&
+           _region_clip(v,address,n)==n && v->port->read(address,buffer,n)!=n) offset = 0;
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(__atomic_load_n(&f->snap_seq,__ATOMIC_RELAXED)!=fseq ||
+           __atomic_load_n(&v->snap_seq,__ATOMIC_RELAXED)!=vseq) continue;
+
+        if(offset==0) return RES_FILE_NOT_FOUND;
+        if(saving && _snap_overlaps(v,address,n)) return RES_BUSY;
+        if(_region_clip(v,address,n)!=n) return RES_READ_ERROR;
+        if(length) *length = n;
+        return RES_OK;
     }
-    
-    pos = _baseaddr;
-    
-    // Loop over the files, find ours and save it
-    for(x=0;x<UTFS_MAX_FILES;x++)
-    {
-        if(file_list[x]!=NULL)
-        {
-            if(strncmp(f->filename,file_list[x]->filename, UTFS_MAX_FILENAME+1)==0)
-            {
-                _utfs_log("Writing file %s, id %d at pos %d\n",f->filename,x,pos);
-                memset(&header,0,sizeof(header));
-                header.ident = UTFS_IDENTIFIER;
-                header.version = UTFS_VERSION_V1;
-                header.flags = ((file_list[x]->flags)&0x00FF);   // Save the lower byte of the flags
-                header.signature = file_list[x]->signature;
-                header.unused = 0;
-                header.size = file_list[x]->size;
-                strncpy((char*)(header.filename),file_list[x]->filename,UTFS_MAX_FILENAME);
-                bptr = (uint8_t*)(file_list[x]->data);
-                
-                // Write header
-                pos += sys_write(pos,&header,sizeof(header));
-
-                // Write data
-                sys_write(pos,bptr,file_list[x]->size);
-            
-                return RES_OK;
-            }
-            pos += sizeof(header)+file_list[x]->size;
-        }
+    return RES_BUSY;
+}
+#endif
+
+#ifdef UTFS_ENABLE_QUEUE
+utfs_result_e utfs_vol_save_request(utfs_volume_t * v, utfs_file_t * f)
+{
+    uint8_t head,next;
+
+    // Only the ring is touched, this can run in an interrupt
+    head = v->queue_head;
+    next = UTFS_QUEUE_NEXT(head);
+    if(next==__atomic_load_n(&v->queue_tail,__ATOMIC_ACQUIRE))
+    {
+        // Full, utfs_vol_service() saves every file instead
+        __atomic_store_n(&v->queue_lost,(uint8_t)(v->queue_lost+1),__ATOMIC_RELEASE);
+        return RES_OK;
     }
+    v->queue[head] = f;
+    __atomic_store_n(&v->queue_head,next,__ATOMIC_RELEASE);
+    return RES_OK;
+}
+#endif
 
-    return RES_FILE_NOT_FOUND;
+#if defined(UTFS_ENABLE_QUEUE) || defined(UTFS_ENABLE_COALESCE)
+utfs_result_e utfs_vol_service(utfs_volume_t * v)
+{
+    _lock(v);
+    return _unlock(v,_service(v,false));
+}
+#endif
+
+utfs_result_e utfs_vol_commit(utfs_volume_t * v)
+{
+#if defined(UTFS_ENABLE_QUEUE) || defined(UTFS_ENABLE_COALESCE)
+    _lock(v);
+    return _unlock(v,_service(v,true));
+#else
+    // Nothing is held back
+    return RES_OK;
+#endif
+}
+
+#ifdef UTFS_ENABLE_COALESCE
+utfs_result_e utfs_vol_coalesce_set(utfs_volume_t * v, uint32_t quiet, uint32_t deadline)
+{
+    _lock(v);
+    v->coalesce_quiet = quiet;
+    v->coalesce_deadline = deadline;
+    return _unlock(v,RES_OK);
 }
+#endif
 
 /// Utility functions
 utfs_result_e utfs_set(utfs_file_t * f,char * name, void * data,uint32_t size)
 {
     if(!f) return RES_PARAM_ERROR;
+    // The hash index files it under its name, unregister it to rename it
+    if(_registered(f) && strncmp(f->filename,name,UTFS_MAX_FILENAME)!=0) return RES_PARAM_ERROR;
     strncpy(f->filename,name,UTFS_MAX_FILENAME);
+    f->hash = _filename_hash(f->filename);
     f->data = data;
     f->size = size;
     return RES_OK;
@@ -471,7 +814,9 @@ utfs_result_e utfs_set(utfs_file_t * f,char * name, void * data,uint32_t size)
 utfs_result_e utfs_set_filename(utfs_file_t * f,char * name)
 {
     if(!f) return RES_PARAM_ERROR;
+    if(_registered(f) && strncmp(f->filename,name,UTFS_MAX_FILENAME)!=0) return RES_PARAM_ERROR;
     strncpy(f->filename,name,UTFS_MAX_FILENAME);
+    f->hash = _filename_hash(f->filename);
     return RES_OK;
 }
 utfs_result_e utfs_set_data(utfs_file_t *f,void * data,uint32_t size)
@@ -481,6 +826,12 @@ utfs_result_e utfs_set_data(utfs_file_t *f,void * data,uint32_t size)
     f->size = size;
     return RES_OK;
 }
+utfs_result_e utfs_set_reserve(utfs_file_t * f, uint32_t reserve)
+{
+    if(!f || reserve>UTFS_RESERVE_MAX) return RES_PARAM_ERROR;
+    f->reserve = reserve;
+    return RES_OK;
+}
 uint16_t utfs_file_signature(utfs_file_t * f)
 {
     if(!f) return 0;
@@ -503,25 +854,146 @@ const char * utfs_result_str(utfs_result_e res)
     case RES_FILENAME_EXISTS: return "RES_FILENAME_EXISTS";
     case RES_FILESYSTEM_FULL: return "RES_FILESYSTEM_FULL";
     case RES_INVALID_FS: return "RES_INVALID_FS";
+    case RES_BUSY: return "RES_BUSY";
     }
     return "RES_UNKNOWN";
 }
 
 /// Debug functions
-utfs_result_e utfs_status()
+utfs_result_e utfs_vol_status(utfs_volume_t * v)
 {
-    int x;
+    uint32_t x;
     int count=0;
-    for(x=0;x<UTFS_MAX_FILES;x++)
+    _lock_shared(v);
+    for(x=0;x<v->file_count;x++)
     {
-        if(file_list[x])
-        {
-            count++;
-            printf("Entry %d: '%s' - %d bytes\n",x,file_list[x]->filename,file_list[x]->size);
-        }
+        count++;
+        printf("Entry %d: '%s' - %d bytes\n",x,v->file_list[x]->filename,v->file_list[x]->size);
     }
     if(count<=0) printf("No UTFS entries found\n");
-    return RES_OK;
+    printf("Last load: %d unknown files on the medium, %d entries not found\n",(int)v->load_unmatched,(int)v->load_missing);
+    return _unlock(v,RES_OK);
+}
+
+// Default volume, the calls without a utfs_volume_t
+// ----------------------------------------------------------------------------
+utfs_volume_t * utfs_default_volume()
+{
+    return &_volume;
+}
+utfs_result_e utfs_init(bool verbose)
+{
+    return utfs_vol_init(&_volume,&_sys_port,verbose);
+}
+utfs_result_e utfs_init_table(bool verbose, utfs_file_t ** table, uint32_t capacity)
+{
+    return utfs_vol_init_table(&_volume,&_sys_port,verbose,table,capacity);
+}
+utfs_result_e utfs_baseaddress_set(uint32_t baseaddr)
+{
+    return utfs_vol_baseaddress_set(&_volume,baseaddr);
+}
+utfs_result_e utfs_size_set(uint32_t size)
+{
+    return utfs_vol_size_set(&_volume,size);
+}
+utfs_result_e utfs_hash_set(utfs_file_t ** buckets, uint32_t count)
+{
+    return utfs_vol_hash_set(&_volume,buckets,count);
+}
+utfs_result_e utfs_scratch_set(void * buffer, uint32_t size)
+{
+    return utfs_vol_scratch_set(&_volume,buffer,size);
+}
+utfs_result_e utfs_register(utfs_file_t * f, utfs_flags_e flags, utfs_options_e options)
+{
+    return utfs_vol_register(&_volume,f,flags,options);
+}
+utfs_result_e utfs_unregister(utfs_file_t * f)
+{
+    return utfs_vol_unregister(&_volume,f);
+}
+utfs_result_e utfs_load()
+{
+    return utfs_vol_load(&_volume);
+}
+utfs_result_e utfs_save()
+{
+    return utfs_vol_save(&_volume);
+}
+utfs_result_e utfs_save_flush()
+{
+    return utfs_vol_save_flush(&_volume);
+}
+utfs_result_e utfs_load_step()
+{
+    return utfs_vol_load_step(&_volume);
+}
+utfs_result_e utfs_save_step()
+{
+    return utfs_vol_save_step(&_volume);
+}
+#ifdef UTFS_ENABLE_ASYNC
+void utfs_io_done(uint32_t length)
+{
+    utfs_vol_io_done(&_volume,length);
+}
+#endif
+utfs_result_e utfs_progress(uint32_t * done, uint32_t * total)
+{
+    return utfs_vol_progress(&_volume,done,total);
+}
+utfs_result_e utfs_load_file(utfs_file_t * f)
+{
+    return utfs_vol_load_file(&_volume,f);
+}
+utfs_result_e utfs_save_file(utfs_file_t * f)
+{
+    return utfs_vol_save_file(&_volume,f);
+}
+utfs_result_e utfs_compact_step()
+{
+    return utfs_vol_compact_step(&_volume);
+}
+utfs_result_e utfs_load_stats(uint32_t * unmatched, uint32_t * missing)
+{
+    return utfs_vol_load_stats(&_volume,unmatched,missing);
+}
+utfs_result_e utfs_mark_dirty(utfs_file_t * f)
+{
+    return utfs_vol_mark_dirty(&_volume,f);
+}
+#ifdef UTFS_ENABLE_SNAPSHOT
+utfs_result_e utfs_snapshot_read(utfs_file_t * f, void * buffer, uint32_t size, uint32_t * length)
+{
+    return utfs_vol_snapshot_read(&_volume,f,buffer,size,length);
+}
+#endif
+#ifdef UTFS_ENABLE_QUEUE
+utfs_result_e utfs_save_request(utfs_file_t * f)
+{
+    return utfs_vol_save_request(&_volume,f);
+}
+#endif
+#if defined(UTFS_ENABLE_QUEUE) || defined(UTFS_ENABLE_COALESCE)
+utfs_result_e utfs_service()
+{
+    return utfs_vol_service(&_volume);
+}
+#endif
+utfs_result_e utfs_commit()
+{
+    return utfs_vol_commit(&_volume);
+}
+#ifdef UTFS_ENABLE_COALESCE
+utfs_result_e utfs_coalesce_set(uint32_t quiet, uint32_t deadline)
+{
+    return utfs_vol_coalesce_set(&_volume,quiet,deadline);
+}
+#endif
+utfs_result_e utfs_status()
+{
+    return utfs_vol_status(&_volume);
 }
 
 // Private functions
@@ -529,14 +1001,2367 @@ utfs_result_e utfs_status()
 static void _print_header(utfs_header_t * header)
 {
     printf("Header:\n");
-    printf(" ident: 0x%04X\n",header->ident);
+    printf(" identifier: 0x%04X\n",header->identifier);
     printf(" version: %d\n",header->version);
     printf(" flags: 0x%02X\n",header->flags);
     printf(" signature: 0x%04X\n",header->signature);
-    printf(" unused: 0x%04X\n",header->unused);
+    printf(" reserved: %d\n",header->reserved);
     printf(" size: %d\n",header->size);
     printf(" filename: '%s'\n",header->filename);
     return;
 }
 
+static void _header_fill(utfs_header_t * header, utfs_file_t * f, uint16_t gap)
+{
+    memset(header,0,sizeof(utfs_header_t));
+    header->identifier = UTFS_IDENTIFIER;
+    header->version = UTFS_VERSION_V1;
+    header->flags = ((f->flags)&0x00FF);   // Save the lower byte of the flags
+    header->signature = f->signature;
+    header->reserved = gap;
+    header->size = f->size;
+    strncpy((char*)(header->filename),f->filename,UTFS_MAX_FILENAME);
+    return;
+}
+
+#ifdef UTFS_PLAIN_WRITE
+// All medium writes from UTFS go through here
+static uint32_t _write(utfs_volume_t * v, uint32_t address, void * ptr, uint32_t length)
+{
+#ifdef UTFS_ENABLE_DIFF_WRITE
+    uint8_t current[UTFS_DIFF_CHUNK];
+    uint8_t * data;
+    uint32_t done,n,got,i;
+    uint32_t start,run,written;
+
+    if(!ptr || length==0) return _medium_write(v,address,ptr,length);
+    data = (uint8_t*)ptr;
+
+    // Read back what is on the medium a chunk at a time, and only write
+    // the runs of bytes that differ
+    run = 0;
+    start = 0;
+    for(done=0;done<length;done+=n)
+    {
+        n = length-done;
+        if(n>UTFS_DIFF_CHUNK) n=UTFS_DIFF_CHUNK;
+        got = _medium_read(v,address+done,current,n);
+        for(i=0;i<n;i++)
+        {
+            if(i<got && current[i]==data[done+i])
+            {
+                if(run>0)
+                {
+                    written = _write_run(v,address+start,&(data[start]),run);
+                    if(written!=run) return start+written;
+                    run = 0;
+                }
+            }else{
+                if(run==0) start = done+i;
+                run++;
+            }
+        }
+    }
+    if(run>0)
+    {
+        written = _write_run(v,address+start,&(data[start]),run);
+        if(written!=run) return start+written;
+    }
+    return length;
+#else
+    return _medium_write(v,address,ptr,length);
+#endif
+}
+#endif
+
+#ifdef UTFS_ENABLE_DIFF_WRITE
+static uint32_t _write_run(utfs_volume_t * v, uint32_t address, uint8_t * data, uint32_t length)
+{
+    _utfs_log("Diff write %d bytes at %d\n",length,address);
+    return _medium_write(v,address,data,length);
+}
+#endif
+
+// All medium reads from UTFS go through here, and through the cache
+// when it is enabled. Blocks that are not cached are read straight from
+// the medium without being added to the cache.
+static uint32_t _medium_read(utfs_volume_t * v, uint32_t address, void * ptr, uint32_t length)
+{
+#ifdef UTFS_ENABLE_CACHE
+    utfs_cache_line_t * line;
+    uint8_t * data;
+    uint32_t done,n,offset,run,got;
+#endif
+
+    // Nothing past the end of the volume
+    if(length>0 && _region_clip(v,address,length)==0) return 0;
+    length = _region_clip(v,address,length);
+
+#ifdef UTFS_ENABLE_CACHE
+    if(!ptr || length==0) return v->port->read(address,ptr,length);
+    data = (uint8_t*)ptr;
+
+    // Runs of uncached blocks are read in one call
+    run = 0;
+    for(done=0;done<length;done+=n)
+    {
+        offset = (address+done)%UTFS_CACHE_ERASE_SIZE;
+        n = UTFS_CACHE_ERASE_SIZE-offset;
+        if(n>length-done) n=length-done;
+        line = _cache_find(v,(address+done)/UTFS_CACHE_ERASE_SIZE);
+        if(!line)
+        {
+            run += n;
+            continue;
+        }
+        if(run>0)
+        {
+            got = v->port->read(address+done-run,&(data[done-run]),run);
+            if(got!=run) return (done-run)+got;
+            run = 0;
+        }
+        if(offset>=line->filled) return done;
+        if(n>line->filled-offset)
+        {
+            memcpy(&(data[done]),&(line->data[offset]),line->filled-offset);
+            return done+(line->filled-offset);
+        }
+        memcpy(&(data[done]),&(line->data[offset]),n);
+    }
+    if(run>0)
+    {
+        got = v->port->read(address+length-run,&(data[length-run]),run);
+        if(got!=run) return (length-run)+got;
+    }
+    return length;
+#else
+    return v->port->read(address,ptr,length);
+#endif
+}
+
+#ifdef UTFS_PLAIN_WRITE
+// Lowest level of the write path. With the cache enabled, writes land in
+// the cached erase blocks and reach sys_write() at the next _commit(), or
+// when the block is evicted.
+static uint32_t _medium_write(utfs_volume_t * v, uint32_t address, void * ptr, uint32_t length)
+{
+#ifdef UTFS_ENABLE_CACHE
+    utfs_cache_line_t * line;
+    uint8_t * data;
+    uint32_t done,n,offset,page;
+#endif
+
+    // Never past the end of the volume, into whatever follows it
+    if(_region_clip(v,address,length)!=length) return 0;
+
+#ifdef UTFS_ENABLE_CACHE
+    if(!ptr || length==0) return v->port->write(address,ptr,length);
+    data = (uint8_t*)ptr;
+
+    for(done=0;done<length;done+=n)
+    {
+        offset = (address+done)%UTFS_CACHE_ERASE_SIZE;
+        n = UTFS_CACHE_ERASE_SIZE-offset;
+        if(n>length-done) n=length-done;
+        line = _cache_line(v,(address+done)/UTFS_CACHE_ERASE_SIZE);
+        if(!line) return done;
+
+        // The whole write is inside the volume, so it may run on past the
+        // bytes the block read back
+        memcpy(&(line->data[offset]),&(data[done]),n);
+        if(offset+n>line->filled) line->filled = offset+n;
+        for(page=offset/UTFS_CACHE_PAGE_SIZE;page<=(offset+n-1)/UTFS_CACHE_PAGE_SIZE;page++)
+        {
+            line->dirty |= (1UL<<page);
+        }
+    }
+    return length;
+#else
+    _snap_touch(v,address,length);
+    return v->port->write(address,ptr,length);
+#endif
+}
+#endif
+
+// End of a save, write back every dirty erase block once. The result of
+// the save is passed through, or the error of the write back.
+static utfs_result_e _commit(utfs_volume_t * v, utfs_result_e res)
+{
+#ifdef UTFS_ENABLE_CACHE
+    utfs_result_e flushed;
+    uint32_t x;
+
+    for(x=0;x<UTFS_CACHE_BLOCKS;x++)
+    {
+        flushed = _cache_line_flush(v,&(v->cache[x]));
+        if(flushed!=RES_OK && res==RES_OK) res = flushed;
+    }
+#endif
+    return res;
+}
+
+#ifdef UTFS_ENABLE_CACHE
+static utfs_cache_line_t * _cache_find(utfs_volume_t * v, uint32_t block)
+{
+    uint32_t x;
+    for(x=0;x<UTFS_CACHE_BLOCKS;x++)
+    {
+        if(v->cache[x].valid && v->cache[x].block==block) return &(v->cache[x]);
+    }
+    return NULL;
+}
+
+// Find an erase block in the cache, or load it in place of the oldest
+static utfs_cache_line_t * _cache_line(utfs_volume_t * v, uint32_t block)
+{
+    utfs_cache_line_t * line;
+    uint32_t x;
+
+    line = _cache_find(v,block);
+    if(line) return line;
+
+    // Take a free line, else the next one round
+    line = NULL;
+    for(x=0;x<UTFS_CACHE_BLOCKS && !line;x++)
+    {
+        if(!v->cache[x].valid) line = &(v->cache[x]);
+    }
+    if(!line)
+    {
+        line = &(v->cache[v->cache_next]);
+        v->cache_next = (v->cache_next+1)%UTFS_CACHE_BLOCKS;
+        _utfs_log("Cache evict block %d\n",line->block);
+        if(_cache_line_flush(v,line)!=RES_OK) return NULL;
+    }
+
+    memset(line->data,0xFF,sizeof(line->data));
+    line->block = block;
+    // The whole erase block, unless the volume ends inside it. A short
+    // read only means the medium has nothing there yet.
+    line->length = _region_clip(v,block*UTFS_CACHE_ERASE_SIZE,UTFS_CACHE_ERASE_SIZE);
+    line->filled = 0;
+    if(line->length>0) line->filled = v->port->read(block*UTFS_CACHE_ERASE_SIZE,line->data,line->length);
+    if(line->filled>line->length) line->filled = line->length;
+    line->dirty = 0;
+    line->valid = true;
+    return line;
+}
+
+// Write the dirty pages of a block back in one sys_write(), from the first
+// dirty page to the last, so the medium erases the block once
+static utfs_result_e _cache_line_flush(utfs_volume_t * v, utfs_cache_line_t * line)
+{
+    uint32_t first,last,start,length;
+
+    if(!line->valid || line->dirty==0) return RES_OK;
+    for(first=0;(line->dirty&(1UL<<first))==0;first++);
+    for(last=UTFS_CACHE_PAGES-1;(line->dirty&(1UL<<last))==0;last--);
+    start = first*UTFS_CACHE_PAGE_SIZE;
+    length = ((last+1)*UTFS_CACHE_PAGE_SIZE)-start;
+    if(start+length>line->filled) length = line->filled-start;
+    line->dirty = 0;
+
+    _utfs_log("Cache write block %d, %d bytes at %d\n",line->block,length,start);
+    _snap_touch(v,(line->block*UTFS_CACHE_ERASE_SIZE)+start,length);
+    // The medium ended inside the block, as a save without the cache would
+    // find when it ran off the end
+    if(v->port->write((line->block*UTFS_CACHE_ERASE_SIZE)+start,&(line->data[start]),length)!=length)
+    {
+        return RES_FILESYSTEM_FULL;
+    }
+    return RES_OK;
+}
+#endif
+
+// Queue a write. With UTFS_ENABLE_VECTORED, writes that follow on from
+// each other are gathered and handed to sys_writev() in one call.
+static utfs_result_e _batch_write(utfs_volume_t * v, utfs_batch_t * b, uint32_t address, void * ptr, uint32_t length)
+{
+    if(length==0) return RES_OK;
+    if(!ptr) return RES_WRITE_ERROR;
+#ifdef UTFS_ENABLE_VECTORED
+    if(b->count>0 && (b->count==UTFS_IOV_MAX || b->address+b->length!=address))
+    {
+        if(_batch_flush(v,b)!=RES_OK) return RES_WRITE_ERROR;
+    }
+    if(b->count==0)
+    {
+        b->address = address;
+        b->length = 0;
+    }
+    b->iov[b->count].ptr = ptr;
+    b->iov[b->count].length = length;
+    b->count++;
+    b->length += length;
+    return RES_OK;
+#else
+    return (_write(v,address,ptr,length)==length) ? RES_OK : RES_WRITE_ERROR;
+#endif
+}
+
+static utfs_result_e _batch_flush(utfs_volume_t * v, utfs_batch_t * b)
+{
+#ifdef UTFS_ENABLE_VECTORED
+    uint32_t written;
+#ifdef UTFS_ENABLE_DIFF_WRITE
+    uint32_t x;
+#endif
+
+    if(b->count==0) return RES_OK;
+#ifdef UTFS_ENABLE_DIFF_WRITE
+    // Each range has to be compared on its own
+    for(x=0,written=0;x<b->count;x++)
+    {
+        if(_write(v,b->address+written,b->iov[x].ptr,b->iov[x].length)!=b->iov[x].length) break;
+        written += b->iov[x].length;
+    }
+#else
+    _utfs_log("Writing %d ranges, %d bytes at %d\n",b->count,b->length,b->address);
+    written = 0;
+    if(_region_clip(v,b->address,b->length)==b->length)
+    {
+        _snap_touch(v,b->address,b->length);
+        written = v->port->writev(b->address,b->iov,b->count);
+    }
+#endif
+    b->count = 0;
+    return (written==b->length) ? RES_OK : RES_WRITE_ERROR;
+#else
+    return RES_OK;
+#endif
+}
+
+static bool _header_valid(utfs_header_t * header)
+{
+    return (header->identifier==UTFS_IDENTIFIER && header->version==UTFS_VERSION_V1);
+}
+
+static bool _header_read(utfs_volume_t * v, uint32_t address, utfs_header_t * header)
+{
+    if(_medium_read(v,address,header,sizeof(utfs_header_t))!=sizeof(utfs_header_t)) return false;
+    return _header_valid(header);
+}
+
+// Remember where a file is on the medium, and what was stored there
+static void _file_resolved(utfs_file_t * f, uint32_t offset, uint32_t size, uint16_t signature, uint8_t flags, uint16_t gap)
+{
+    f->offset = offset;
+    f->size_stored = size;
+    f->signature_stored = signature;
+    f->flags_stored = flags;
+    f->gap_stored = gap;
+    return;
+}
+
+// Padding to put after 'address' so the next header starts on an
+// UTFS_ALIGN_SIZE boundary of the medium
+static uint16_t _align_gap(uint32_t address)
+{
+#ifdef UTFS_ENABLE_ALIGN
+    return (UTFS_ALIGN_SIZE-(address&(UTFS_ALIGN_SIZE-1)))&(UTFS_ALIGN_SIZE-1);
+#else
+    return 0;
+#endif
+}
+
+// Padding to leave after a file whose data starts at 'offset'. A file
+// that is still where it was keeps its slot, so the files after it do
+// not move. Otherwise it gets a new slot with its reserve to grow into.
+// See _file_fits() for when a slot is kept.
+static uint16_t _file_gap(utfs_volume_t * v, utfs_file_t * f, uint32_t offset)
+{
+    if(f->offset==offset && _file_fits(f))
+    {
+        return (f->size_stored+f->gap_stored)-f->size;
+    }
+    return f->reserve+_align_gap(v->baseaddr+offset+f->size+f->reserve);
+}
+
+// Can the file be written where it is, within the slot it had
+static bool _file_fits(utfs_file_t * f)
+{
+    uint32_t slot;
+
+    if(f->offset==0 || f->gap_stored==UTFS_GAP_UNKNOWN) return false;
+#ifndef UTFS_ENABLE_ALIGN
+    // Without a reserve the volume stays packed, a file that changes size
+    // moves the files after it
+    if(f->reserve==0) return (f->size==f->size_stored);
+#endif
+    slot = f->size_stored+f->gap_stored;
+    return (f->size<=slot && slot-f->size<UTFS_GAP_UNKNOWN);
+}
+
+#ifdef UTFS_ENABLE_MAPPED
+// Point a mapped file at its bytes on the medium instead of reading them
+static void _file_map(utfs_volume_t * v, utfs_file_t * f)
+{
+    // Only bytes inside the volume
+    f->data = NULL;
+    if(_region_clip(v,v->baseaddr+f->offset,f->size_stored)==f->size_stored)
+    {
+        f->data = v->port->map(v->baseaddr+f->offset,f->size_stored);
+    }
+    f->size = f->size_stored;
+    f->size_loaded = (f->data!=NULL) ? f->size : 0;
+    f->signature=f->signature_stored;
+    f->flags&=(0xFF00); // blank the lower byte
+    f->flags|=f->flags_stored; // Add in the lower byte flags from the medium
+    f->state &= ~UTFS_STATE_DIRTY;
+    return;
+}
+#endif
+
+// Walk the layout the save would write, before writing anything. A mapped
+// file's data is the medium itself so it can't move, and with a volume
+// size set every file has to fit in it.
+static utfs_result_e _layout_check(utfs_volume_t * v)
+{
+    utfs_file_t * f;
+    uint32_t x,offset,end;
+
+    offset = 0;
+#ifdef UTFS_ENABLE_DIRECTORY
+    offset = sizeof(utfs_dir_header_t)+(v->file_count*sizeof(utfs_dir_entry_t));
+    offset += _align_gap(v->baseaddr+offset);
+#endif
+    end = offset;
+    for(x=0;x<v->file_count;x++)
+    {
+        f = v->file_list[x];
+        offset += sizeof(utfs_header_t);
+#ifdef UTFS_ENABLE_MAPPED
+        if((f->flags&UTFS_MAPPED)!=0 && f->offset!=0 && f->offset!=offset)
+        {
+            _utfs_log("A mapped file would move, not saving\n");
+            return RES_PARAM_ERROR;
+        }
+#endif
+        // The padding after the last file is not written
+        end = offset+f->size;
+        offset = end+_file_gap(v,f,offset);
+    }
+    if(v->size!=0 && end>v->size)
+    {
+        _utfs_log("Files need %d bytes, the volume holds %d\n",(int)end,(int)v->size);
+        return RES_FILESYSTEM_FULL;
+    }
+    return RES_OK;
+}
+
+// Bytes of a transfer that fall inside the volume, see utfs_vol_size_set()
+static uint32_t _region_clip(utfs_volume_t * v, uint32_t address, uint32_t length)
+{
+    uint32_t end;
+
+    if(v->size==0) return length;
+    end = v->baseaddr+v->size;
+    if(address>=end) return 0;
+    if(length>end-address) return end-address;
+    return length;
+}
+
+// Unregister every file and free the locks, before the volume is set up
+// again
+static void _vol_release(utfs_volume_t * v)
+{
+    uint32_t x;
+
+    for(x=0;x<v->file_count;x++)
+    {
+        v->file_list[x]->registered = 0;
+#ifdef UTFS_ENABLE_LOCK
+        pthread_mutex_destroy(&v->file_list[x]->lock);
+#endif
+    }
+#ifdef UTFS_ENABLE_LOCK
+    pthread_rwlock_destroy(&v->lock);
+#endif
+    return;
+}
+
+static void _file_forget(utfs_volume_t * v)
+{
+    uint32_t x;
+    for(x=0;x<v->file_count;x++) v->file_list[x]->offset = 0;
+    return;
+}
+
+// Read a file from its known offset
+static utfs_result_e _file_read(utfs_volume_t * v, utfs_file_t * f)
+{
+    uint32_t s;
+
+#ifdef UTFS_ENABLE_MAPPED
+    if((f->flags&UTFS_MAPPED)!=0)
+    {
+        _file_map(v,f);
+        return RES_OK;
+    }
+#endif
+
+    // Handle null
+    if(f->data==NULL){
+        _utfs_log("Null data, skipping\n");
+        return RES_OK;
+    }
+
+    // The file is saved with a size, but if this application
+    // has a smaller buffer, only read in that much
+    s = f->size_stored;
+    if(s>f->size) s=f->size;
+
+    if(_medium_read(v,v->baseaddr+f->offset, f->data, s)!=s) return RES_READ_ERROR;
+    _file_loaded(f,s);
+    return RES_OK;
+}
+
+// The first 's' bytes of the file's data have been read from its offset
+static void _file_loaded(utfs_file_t * f, uint32_t s)
+{
+    _file_clean(f);
+    f->size_loaded=s;
+    f->signature=f->signature_stored;
+    f->flags&=(0xFF00); // blank the lower byte
+    f->flags|=f->flags_stored; // Add in the lower byte flags from the medium
+    return;
+}
+
+// The data in RAM now matches the medium
+static void _file_clean(utfs_file_t * f)
+{
+    f->state &= ~UTFS_STATE_DIRTY;
+#ifdef UTFS_DATA_HASH
+    f->data_hash = _data_hash(UTFS_FNV_OFFSET,f->data,f->size);
+#endif
+    return;
+}
+
+#ifdef UTFS_ENABLE_INCREMENTAL
+// Has the data changed since it was last loaded or saved
+static bool _file_changed(utfs_file_t * f)
+{
+    if(f->state&UTFS_STATE_DIRTY) return true;
+#ifdef UTFS_DATA_HASH
+    if(f->data_hash!=_data_hash(UTFS_FNV_OFFSET,f->data,f->size)) return true;
+#endif
+    return false;
+}
+#endif
+
+// Start a load or save, run it with _load_run() / _save_run()
+static utfs_result_e _op_begin(utfs_volume_t * v, uint8_t op, bool flush, bool commit)
+{
+    if(v->op.op!=UTFS_OP_NONE) return RES_BUSY;
+    memset(&v->op,0,sizeof(v->op));
+    v->op.op = op;
+    v->op.phase = UTFS_PHASE_START;
+    v->op.flush = flush;
+    v->op.commit = commit;
+    v->op.pos = v->baseaddr;
+    return RES_OK;
+}
+
+static utfs_result_e _op_end(utfs_volume_t * v, utfs_result_e res)
+{
+    if(v->op.commit) res = _commit(v,res);
+    v->op.op = UTFS_OP_NONE;
+    return res;
+}
+
+static utfs_result_e _load_all(utfs_volume_t * v)
+{
+    if(_op_begin(v,UTFS_OP_LOAD,false,false)!=RES_OK) return RES_BUSY;
+    return _load_run(v,0);
+}
+
+static utfs_result_e _save_all(utfs_volume_t * v, bool flush)
+{
+    if(_op_begin(v,UTFS_OP_SAVE,flush,false)!=RES_OK) return RES_BUSY;
+    return _save_run(v,0);
+}
+
+// Body of utfs_vol_save() and utfs_vol_save_flush(), with the volume locked
+static utfs_result_e _save(utfs_volume_t * v, bool flush)
+{
+#ifdef UTFS_ENABLE_COALESCE
+    // This writes what a pending utfs_save() asked for
+    v->save_pending = false;
+#endif
+#ifdef UTFS_ENABLE_LOG_VOLUME
+    return _commit(v,_log_save(v,flush,NULL));
+#else
+    _snap_begin(v);
+    return _snap_end(v,_commit(v,_save_all(v,flush)));
+#endif
+}
+
+#ifdef UTFS_ENABLE_QUEUE
+// Take the requests posted so far off the ring, marking each file once
+static void _queue_drain(utfs_volume_t * v)
+{
+    uint8_t head,tail,lost;
+    utfs_file_t * f;
+    utfs_file_t * entry;
+
+    head = __atomic_load_n(&v->queue_head,__ATOMIC_ACQUIRE);
+    tail = v->queue_tail;
+    while(tail!=head)
+    {
+        f = v->queue[tail];
+        tail = UTFS_QUEUE_NEXT(tail);
+        if(!f)
+        {
+            v->queue_all = true;
+            continue;
+        }
+        entry = _file_find(v,f->filename,_filename_hash(f->filename));
+        if(!entry)
+        {
+            _utfs_log("Save request for '%s', not registered\n",f->filename);
+            continue;
+        }
+        entry->state |= UTFS_STATE_QUEUED;
+    }
+    // The slots can be filled again
+    __atomic_store_n(&v->queue_tail,tail,__ATOMIC_RELEASE);
+
+    // Requests that found the ring full
+    lost = __atomic_load_n(&v->queue_lost,__ATOMIC_ACQUIRE);
+    if(lost!=v->queue_lost_seen)
+    {
+        _utfs_log("Save requests lost, saving every file\n");
+        v->queue_lost_seen = lost;
+        v->queue_flush = true;
+    }
+    return;
+}
+// Save the files drained from the ring, with the volume locked and no step
+// operation running
+static utfs_result_e _queue_save(utfs_volume_t * v)
+{
+    uint32_t x;
+    bool all,flush;
+    utfs_file_t * f;
+    utfs_result_e res,first=RES_OK;
+
+    // A request for the whole volume is a utfs_save(), lost requests
+    // could have been for any file and are a utfs_save_flush()
+    all = v->queue_all;
+    flush = v->queue_flush;
+    v->queue_all = false;
+    v->queue_flush = false;
+    if(all || flush)
+    {
+        // The files asked for on their own are written by it too
+        for(x=0;x<v->file_count;x++)
+        {
+            if(v->file_list[x]->state&UTFS_STATE_QUEUED) v->file_list[x]->state |= UTFS_STATE_DIRTY;
+        }
+        first = _save(v,flush);
+    }
+    for(x=0;x<v->file_count;x++)
+    {
+        f = v->file_list[x];
+        if((f->state&UTFS_STATE_QUEUED)==0) continue;
+        f->state &= ~UTFS_STATE_QUEUED;
+        if(flush) continue;
+#ifdef UTFS_ENABLE_FLAGS
+        if(all && (f->flags&UTFS_SAVE_EXPLICIT)==0) continue;
+#else
+        if(all) continue;
+#endif
+        res = _save_file(v,f);
+        if(first==RES_OK) first = res;
+    }
+    return first;
+}
+#endif
+
+#ifdef UTFS_ENABLE_COALESCE
+// Record a utfs_save() to write later
+static void _coalesce_pend(utfs_volume_t * v)
+{
+    uint32_t now;
+
+    now = v->port->tick();
+    if(!v->save_pending)
+    {
+        v->save_pending = true;
+        v->save_first = now;
+    }
+    v->save_last = now;
+    return;
+}
+
+// Has the quiet interval or the deadline passed, ticks may wrap
+static bool _coalesce_due(utfs_volume_t * v)
+{
+    uint32_t now;
+
+    now = v->port->tick();
+    if((uint32_t)(now-v->save_last)>=v->coalesce_quiet) return true;
+    if(v->coalesce_deadline>0 && (uint32_t)(now-v->save_first)>=v->coalesce_deadline) return true;
+    return false;
+}
+#endif
+
+#if defined(UTFS_ENABLE_QUEUE) || defined(UTFS_ENABLE_COALESCE)
+// Save what was asked for and held back, the pending save only once it is
+// due unless now is set. The volume is locked.
+static utfs_result_e _service(utfs_volume_t * v, bool now)
+{
+    utfs_result_e res=RES_OK;
+
+#ifdef UTFS_ENABLE_QUEUE
+    _queue_drain(v);
+#endif
+
+    // The requests wait until the step operation is done
+    if(v->op.op!=UTFS_OP_NONE) return RES_BUSY;
+
+#ifdef UTFS_ENABLE_QUEUE
+    res = _queue_save(v);
+#endif
+#ifdef UTFS_ENABLE_COALESCE
+    if(v->save_pending && (now || _coalesce_due(v)))
+    {
+        utfs_result_e saved;
+
+        _utfs_log("Writing the coalesced save\n");
+        saved = _save(v,false);
+        if(saved!=RES_OK) _coalesce_pend(v);
+        if(res==RES_OK) res = saved;
+    }
+#endif
+    return res;
+}
+#endif
+
+// Body of utfs_vol_load_file(), with the volume locked
+static utfs_result_e _load_file(utfs_volume_t * v, utfs_file_t * f)
+{
+    uint32_t x;
+    uint32_t pos;
+    utfs_file_t * entry;
+    utfs_header_t header;
+    
+    if(v->op.op!=UTFS_OP_NONE) return RES_BUSY;
+
+    // Find the registered file
+    entry = _file_find(v,f->filename,_filename_hash(f->filename));
+    if(!entry) return RES_FILE_NOT_FOUND;
+
+    // Already know where it is from a load or save
+    if(entry->offset!=0) return _snap_file(v,entry,_file_read(v,entry));
+
+#ifdef UTFS_ENABLE_LOG_VOLUME
+    // Scanning the log finds every registered file at once
+    if(!v->log_mounted) _log_mount(v);
+    if(entry->offset!=0) return _snap_file(v,entry,_file_read(v,entry));
+    return RES_FILE_NOT_FOUND;
+#endif
+
+#ifdef UTFS_ENABLE_DIRECTORY
+    {
+        utfs_result_e res;
+        utfs_dir_entry_t dirent;
+
+        // With a directory the data can be read directly
+        res = _dir_find(v,entry,&dirent,NULL);
+        if(res==RES_OK)
+        {
+            _file_resolved(entry,dirent.offset,dirent.size,dirent.signature,dirent.flags,UTFS_GAP_UNKNOWN);
+            return _snap_file(v,entry,_file_read(v,entry));
+        }
+        if(res!=RES_INVALID_FS) return res;
+
+        // No directory on the medium, find the file by its header
+    }
+#endif
+
+    pos = v->baseaddr;
+
+    // Support up to as many files as the table can hold
+    for(x=0;x<v->file_capacity;x++)
+    {
+        // Read the header
+        if(!_header_read(v,pos,&header))
+        {
+            return RES_FILE_NOT_FOUND;
+        }
+        pos += sizeof(header);
+        
+        // is it a match?
+        if(strncmp(entry->filename,header.filename,UTFS_MAX_FILENAME+1)!=0)
+        {
+            // No, just skip the data
+            pos += header.size+header.reserved;
+            continue;
+        }
+
+        // It is a match
+        _utfs_log("Found file to load, pos %d\n",pos);
+        if(v->verbose) _print_header(&header);
+        _file_resolved(entry,pos-v->baseaddr,header.size,header.signature,header.flags,header.reserved);
+        return _snap_file(v,entry,_file_read(v,entry));
+    }
+    
+    return RES_FILE_NOT_FOUND;
+}
+
+// Body of utfs_vol_save_file(), with the volume locked
+static utfs_result_e _save_file(utfs_volume_t * v, utfs_file_t * f)
+{
+    uint32_t pos;
+    utfs_file_t * entry;
+    utfs_header_t header;
+    utfs_batch_t batch;
+    
+    if(v->op.op!=UTFS_OP_NONE) return RES_BUSY;
+
+    // Find the registered file
+    entry = _file_find(v,f->filename,_filename_hash(f->filename));
+    if(!entry) return RES_FILE_NOT_FOUND;
+
+#ifdef UTFS_ENABLE_LOG_VOLUME
+    return _commit(v,_log_save(v,false,entry));
+#endif
+#ifdef UTFS_ENABLE_MAPPED
+    // Read only once it is on the medium
+    if((entry->flags&UTFS_MAPPED)!=0 && entry->offset!=0) return RES_PARAM_ERROR;
+#endif
+    
+    // The header carries the padding after the data, learn it if the
+    // file was found through the directory
+    if(entry->offset!=0 && entry->gap_stored==UTFS_GAP_UNKNOWN)
+    {
+        if(!_header_read(v,v->baseaddr+entry->offset-sizeof(header),&header)) return RES_READ_ERROR;
+        entry->gap_stored = header.reserved;
+    }
+
+    // We can't save an individual file until the full set of files
+    // have been written, so if it is not on the medium or has outgrown
+    // its slot, write them first
+    if(!_file_fits(entry)){
+        // Save the structure, fails if it overflows
+        // the medium; aka fs full
+        _utfs_log("%s not in place, saving structure\n",entry->filename);
+        _snap_begin(v);
+        if(_save_all(v,false)!=RES_OK)
+        {
+            _utfs_log("Fatal error, fs full\n");
+            return _snap_end(v,_commit(v,RES_FILESYSTEM_FULL));
+        }
+    }
+
+    // Write it where the last load or save put it, the padding takes up
+    // whatever is left of the slot
+    pos = v->baseaddr+entry->offset;
+    _utfs_log("Writing file %s at pos %d\n",entry->filename,pos);
+    _header_fill(&header,entry,_file_gap(v,entry,entry->offset));
+    _snap_file_begin(entry);
+    batch.count = 0;
+    if(_batch_write(v,&batch,pos-sizeof(header),&header,sizeof(header))!=RES_OK ||
+       _batch_write(v,&batch,pos,entry->data,entry->size)!=RES_OK ||
+       _batch_flush(v,&batch)!=RES_OK) return _snap_file_end(v,entry,_commit(v,RES_WRITE_ERROR));
+
+#ifdef UTFS_ENABLE_DIRECTORY
+    // Keep the directory copy of the size, signature and flags in step
+    if(v->dir_present && (entry->size_stored!=header.size ||
+       entry->signature_stored!=header.signature || entry->flags_stored!=header.flags))
+    {
+        utfs_dir_entry_t dirent;
+        uint32_t index;
+
+        if(_dir_find(v,entry,&dirent,&index)==RES_OK)
+        {
+            dirent.size = header.size;
+            dirent.signature = header.signature;
+            dirent.flags = header.flags;
+            pos = v->baseaddr+sizeof(utfs_dir_header_t)+(index*sizeof(dirent));
+            if(_write(v,pos,&dirent,sizeof(dirent))!=sizeof(dirent)) return _snap_file_end(v,entry,_commit(v,RES_WRITE_ERROR));
+        }
+    }
+#endif
+    _file_resolved(entry,entry->offset,header.size,header.signature,header.flags,header.reserved);
+    _file_clean(entry);
+
+    return _snap_file_end(v,entry,_commit(v,RES_OK));
+}
+
+// Hold the volume exclusively, see UTFS_ENABLE_LOCK
+static void _lock(utfs_volume_t * v)
+{
+#ifdef UTFS_ENABLE_LOCK
+    pthread_rwlock_wrlock(&v->lock);
+#endif
+    return;
+}
+
+// Share the volume with other readers and single file loads and saves
+static void _lock_shared(utfs_volume_t * v)
+{
+#ifdef UTFS_ENABLE_LOCK
+    pthread_rwlock_rdlock(&v->lock);
+#endif
+    return;
+}
+
+// Let go of the volume, the result passes through
+static utfs_result_e _unlock(utfs_volume_t * v, utfs_result_e res)
+{
+#ifdef UTFS_ENABLE_LOCK
+    pthread_rwlock_unlock(&v->lock);
+#endif
+    return res;
+}
+
+// Only taken with the volume shared, so never while it is held exclusively
+static void _file_lock(utfs_file_t * f)
+{
+#ifdef UTFS_ENABLE_LOCK
+    pthread_mutex_lock(&f->lock);
+#endif
+    return;
+}
+
+static void _file_unlock(utfs_file_t * f)
+{
+#ifdef UTFS_ENABLE_LOCK
+    pthread_mutex_unlock(&f->lock);
+#endif
+    return;
+}
+
+// Snapshot reads, see utfs_vol_snapshot_read(). The volume's snap_seq is
+// odd from the start of a save until the end of its write back, and
+// snap_low / snap_high hold the range of the medium it has written. A
+// file's snap_seq is odd while it is saved on its own. Without
+// UTFS_ENABLE_SNAPSHOT these do nothing.
+static void _snap_begin(utfs_volume_t * v)
+{
+#ifdef UTFS_ENABLE_SNAPSHOT
+    if(v->snap_seq&1) return;
+    __atomic_store_n(&v->snap_seq,v->snap_seq+1,__ATOMIC_RELAXED);
+    __atomic_store_n(&v->snap_low,0xFFFFFFFF,__ATOMIC_RELAXED);
+    __atomic_store_n(&v->snap_high,0,__ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+#endif
+    return;
+}
+
+// End of a load or save, readers get the new places of the files. After a
+// failed save a file keeps its old place, unless the save wrote over it.
+// The result passes through, and a step operation that is still running
+// is left alone.
+static utfs_result_e _snap_end(utfs_volume_t * v, utfs_result_e res)
+{
+#ifdef UTFS_ENABLE_SNAPSHOT
+    uint32_t x,offset,size;
+    utfs_file_t * f;
+    bool saving;
+
+    if(res==RES_BUSY && v->op.op!=UTFS_OP_NONE) return res;
+    saving = (v->snap_seq&1)!=0;
+    if(!saving)
+    {
+        __atomic_store_n(&v->snap_seq,v->snap_seq+1,__ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+    }
+    for(x=0;x<v->file_count;x++)
+    {
+        f = v->file_list[x];
+        offset = f->offset;
+        size = f->size_stored;
+        if(saving && res!=RES_OK)
+        {
+            offset = f->snap_offset;
+            size = f->snap_size;
+            if(_snap_overlaps(v,v->baseaddr+offset,size)) offset = 0;
+        }
+        __atomic_store_n(&f->snap_offset,offset,__ATOMIC_RELAXED);
+        __atomic_store_n(&f->snap_size,size,__ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&v->snap_seq,v->snap_seq+1,__ATOMIC_RELEASE);
+#endif
+    return res;
+}
+
+// Called before each write to the medium
+static void _snap_touch(utfs_volume_t * v, uint32_t address, uint32_t length)
+{
+#ifdef UTFS_ENABLE_SNAPSHOT
+    // Only a running save has readers looking at the range
+    if((__atomic_load_n(&v->snap_seq,__ATOMIC_RELAXED)&1)==0) return;
+    if(address<v->snap_low) __atomic_store_n(&v->snap_low,address,__ATOMIC_RELAXED);
+    if(address+length>v->snap_high) __atomic_store_n(&v->snap_high,address+length,__ATOMIC_RELAXED);
+
+    // Readers see the range before any of the bytes written to it
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+#endif
+    return;
+}
+
+static void _snap_file_begin(utfs_file_t * f)
+{
+#ifdef UTFS_ENABLE_SNAPSHOT
+    __atomic_store_n(&f->snap_seq,f->snap_seq+1,__ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+#endif
+    return;
+}
+
+// End of a single file load or save, and of the save of the whole volume
+// it may have needed first. The result passes through.
+static utfs_result_e _snap_file_end(utfs_volume_t * v, utfs_file_t * f, utfs_result_e res)
+{
+#ifdef UTFS_ENABLE_SNAPSHOT
+    __atomic_store_n(&f->snap_offset,(res==RES_OK)?f->offset:0,__ATOMIC_RELAXED);
+    __atomic_store_n(&f->snap_size,f->size_stored,__ATOMIC_RELAXED);
+    __atomic_store_n(&f->snap_seq,f->snap_seq+1,__ATOMIC_RELEASE);
+    if(__atomic_load_n(&v->snap_seq,__ATOMIC_RELAXED)&1) res = _snap_end(v,res);
+#endif
+    return res;
+}
+
+// A single file load, only where the file is changes
+static utfs_result_e _snap_file(utfs_volume_t * v, utfs_file_t * f, utfs_result_e res)
+{
+    _snap_file_begin(f);
+    return _snap_file_end(v,f,res);
+}
+
+#ifdef UTFS_ENABLE_SNAPSHOT
+// Has the running save written any of these bytes
+static bool _snap_overlaps(utfs_volume_t * v, uint32_t address, uint32_t length)
+{
+    uint32_t low,high;
+
+    low = __atomic_load_n(&v->snap_low,__ATOMIC_RELAXED);
+    high = __atomic_load_n(&v->snap_high,__ATOMIC_RELAXED);
+    return (length>0 && address<high && address+length>low);
+}
+#endif
+
+#ifdef UTFS_ENABLE_LOCK
+// Can the file be loaded or saved touching only its own header, data and
+// directory entry. Anything else, finding the file or moving it, changes
+// state other threads use.
+static bool _file_in_place(utfs_file_t * f, bool save)
+{
+#if defined(UTFS_ENABLE_CACHE) || defined(UTFS_ENABLE_LOG_VOLUME)
+    // Cache lines and the log tail are shared by every file
+    return false;
+#else
+    if(save) return _file_fits(f);
+    return (f->offset!=0);
+#endif
+}
+
+// Load or save a file that is in place with the volume shared, so other
+// files can be loaded and saved at the same time. Returns false, without
+// doing anything, if it needs the volume held exclusively.
+static bool _file_shared(utfs_volume_t * v, utfs_file_t * f, bool save, utfs_result_e * res)
+{
+    utfs_file_t * entry;
+    bool done = false;
+
+    _lock_shared(v);
+    entry = _file_find(v,f->filename,_filename_hash(f->filename));
+#ifdef UTFS_ENABLE_DIRECTORY
+    // Learning whether there is a directory updates the volume, so until
+    // it is known the file goes through the exclusive hold
+    if(!v->dir_checked) entry = NULL;
+#endif
+    if(entry && v->op.op==UTFS_OP_NONE)
+    {
+        // Another save of the same file may have moved it meanwhile
+        _file_lock(entry);
+        if(_file_in_place(entry,save))
+        {
+            *res = save ? _save_file(v,entry) : _load_file(v,entry);
+            done = true;
+        }
+        _file_unlock(entry);
+    }
+    _unlock(v,RES_OK);
+    return done;
+}
+#endif
+
+// Read headers and load the registered files, until 'budget' bytes have
+// been read (0 for no limit). Returns RES_BUSY if there is more to do.
+static utfs_result_e _load_run(utfs_volume_t * v, uint32_t budget)
+{
+    utfs_header_t * header;
+    utfs_file_t * f;
+    uint32_t used,n;
+#ifdef UTFS_ENABLE_VECTORED
+    utfs_iovec_t iov[2];
+#endif
+
+#ifdef UTFS_ENABLE_LOG_VOLUME
+    return _log_load_run(v,budget);
+#endif
+    header = &(v->op.header);
+    used = 0;
+    while(budget==0 || used<budget)
+    {
+        switch(v->op.phase)
+        {
+        case UTFS_PHASE_START:
+            // Forget where files were, the medium may have changed
+            _file_forget(v);
+            v->op.unresolved = v->file_count;
+            v->scratch_len = 0;
+
+#ifdef UTFS_ENABLE_DIRECTORY
+            // Step over the directory, the headers after it carry the names
+            v->dir_checked=false;
+            if(_dir_check(v)==RES_OK) v->op.pos += _dir_size(v);
+            used += sizeof(utfs_dir_header_t);
+#endif
+            v->op.phase = UTFS_PHASE_HEADER;
+            break;
+
+        case UTFS_PHASE_HEADER:
+            // Read up to as many files as the table can hold, and stop once
+            // every registered file has turned up
+            if(v->op.index==v->file_capacity || (v->op.index>0 && v->op.unresolved==0))
+            {
+                v->op.phase = UTFS_PHASE_END;
+                break;
+            }
+            if(v->op.fetched)
+            {
+                // Came in with the data of the file before
+                v->op.fetched = false;
+                if(!v->op.valid)
+                {
+                    v->op.phase = UTFS_PHASE_END;
+                    break;
+                }
+            }else{
+                if(used>0 && budget>0 && used+sizeof(utfs_header_t)>budget) goto step_done;
+                used += sizeof(utfs_header_t);
+                if(_load_read(v,v->op.pos,header,sizeof(utfs_header_t))!=sizeof(utfs_header_t) || !_header_valid(header))
+                {
+                    v->op.phase = UTFS_PHASE_END;
+                    break;
+                }
+            }
+            _load_parse(v,header);
+            v->op.phase = UTFS_PHASE_DATA;
+            break;
+
+        case UTFS_PHASE_DATA:
+            f = v->op.f;
+            if(f && v->op.done<v->op.size)
+            {
+                n = v->op.size-v->op.done;
+                if(budget>0 && n>budget-used) n = budget-used;
+#ifdef UTFS_ENABLE_VECTORED
+                // Read the rest of the data and the header after it in one transfer
+                if(v->scratch_size==0 && v->op.done+n==header->size && header->reserved==0 && v->op.index+1<v->file_capacity && v->op.unresolved>0 &&
+                   (budget==0 || used+n+sizeof(utfs_header_t)<=budget) &&
+                   _region_clip(v,v->op.pos+v->op.done,n+sizeof(utfs_header_t))==n+sizeof(utfs_header_t))
+                {
+                    iov[0].ptr = (uint8_t*)(f->data)+v->op.done;
+                    iov[0].length = n;
+                    iov[1].ptr = header;
+                    iov[1].length = sizeof(utfs_header_t);
+                    v->op.fetched = true;
+                    v->op.valid = (v->port->readv(v->op.pos+v->op.done,iov,2)==n+sizeof(utfs_header_t) && _header_valid(header));
+                    used += sizeof(utfs_header_t);
+                }else
+#endif
+                {
+                    _load_read(v,v->op.pos+v->op.done,(uint8_t*)(f->data)+v->op.done,n);
+                }
+                v->op.done += n;
+                used += n;
+                if(v->op.done<v->op.size) break;
+            }
+            if(f)
+            {
+                _file_clean(f);
+                v->op.loaded++;
+            }
+            v->op.pos = v->op.next;
+            v->op.index++;
+            v->op.phase = UTFS_PHASE_HEADER;
+            break;
+
+        default:
+            v->load_unmatched = v->op.unmatched;
+            v->load_missing = v->op.unresolved;
+
+            // If we didn't load anything
+            if(v->op.index==0)
+            {
+                _utfs_log("Error loading FS\n");
+                return _op_end(v,RES_INVALID_FS);
+            }
+            return _op_end(v,RES_OK);
+        }
+    }
+step_done:
+    return RES_BUSY;
+}
+
+// Write the directory (V2) and then every file, in registration order,
+// until 'budget' bytes have been written (0 for no limit). Returns RES_BUSY
+// if there is more to do. With UTFS_ENABLE_INCREMENTAL, files that are in
+// place and unchanged are skipped, unless this is a flush.
+static utfs_result_e _save_run(utfs_volume_t * v, uint32_t budget)
+{
+    utfs_result_e res;
+    uint32_t used,n;
+    bool write_header;
+    utfs_file_t * f;
+    utfs_header_t * header;
+
+#ifdef UTFS_ENABLE_LOG_VOLUME
+    return _log_save_run(v,budget);
+#endif
+    used = 0;
+    while(budget==0 || used<budget)
+    {
+#ifdef UTFS_ENABLE_ASYNC
+        // One transfer at a time, the next step picks up when it is done
+        if(v->op.io!=UTFS_IO_NONE)
+        {
+            if(v->io_pending) return RES_BUSY;
+            v->op.io = UTFS_IO_NONE;
+            if(v->io_length!=v->op.io_length)
+            {
+                _utfs_log("Error saving %s\n",v->op.f->filename);
+                v->op.f->state |= UTFS_STATE_DIRTY;
+                return _op_end(v,RES_FILESYSTEM_FULL);
+            }
+        }
+#endif
+        switch(v->op.phase)
+        {
+        case UTFS_PHASE_START:
+            res = _layout_check(v);
+            if(res!=RES_OK) return _op_end(v,res);
+#ifdef UTFS_ENABLE_DIRECTORY
+            // Directory first, the file headers follow it
+            if(_dir_begin(v)!=RES_OK)
+            {
+                _utfs_log("Error writing directory, fs full\n");
+                return _op_end(v,RES_FILESYSTEM_FULL);
+            }
+            used += sizeof(utfs_dir_header_t);
+            v->op.phase = UTFS_PHASE_DIR;
+            break;
+#else
+            v->op.phase = UTFS_PHASE_HEADER;
+            break;
+#endif
+
+#ifdef UTFS_ENABLE_DIRECTORY
+        case UTFS_PHASE_DIR:
+            if(v->op.dir_entry==v->file_count)
+            {
+                v->op.pos += _dir_size(v);
+                v->op.phase = UTFS_PHASE_HEADER;
+                break;
+            }
+            if(used>0 && budget>0 && used+(UTFS_DIR_CHUNK*sizeof(utfs_dir_entry_t))>budget) goto step_done;
+            if(_dir_chunk(v,&n)!=RES_OK)
+            {
+                _utfs_log("Error writing directory, fs full\n");
+                return _op_end(v,RES_FILESYSTEM_FULL);
+            }
+            used += n;
+            break;
+#endif
+
+        case UTFS_PHASE_HEADER:
+            if(v->op.index==v->file_count)
+            {
+                v->op.phase = UTFS_PHASE_END;
+                break;
+            }
+            if(used>0 && budget>0 && used+sizeof(utfs_header_t)>budget) goto step_done;
+            f = v->file_list[v->op.index];
+            v->op.f = f;
+
+            // Headers have to stay put until the batch holding them is written
+            if(v->op.h==UTFS_BATCH_HEADERS)
+            {
+                if(_batch_flush(v,&(v->op.batch))!=RES_OK)
+                {
+                    _utfs_log("Error writing batch, fs full\n");
+                    return _op_end(v,RES_FILESYSTEM_FULL);
+                }
+                v->op.h = 0;
+            }
+            header = &(v->op.headers[v->op.h++]);
+            v->op.gap = _file_gap(v,f,(v->op.pos+sizeof(utfs_header_t))-v->baseaddr);
+            _header_fill(header,f,v->op.gap);
+
+            // A file that moved or changed size needs all of it written
+            write_header = v->op.write_data = true;
+#ifdef UTFS_ENABLE_INCREMENTAL
+            if(!v->op.flush && f->offset==(v->op.pos+sizeof(utfs_header_t))-v->baseaddr && f->size_stored==f->size)
+            {
+                write_header = (f->signature_stored!=header->signature || f->flags_stored!=header->flags || f->gap_stored!=v->op.gap);
+                v->op.write_data = _file_changed(f);
+            }
+#endif
+            #ifdef UTFS_ENABLE_FLAGS
+            if(!v->op.flush && (f->flags&UTFS_SAVE_EXPLICIT)!=0)
+            {
+                _utfs_log("SAVE_EXPLICIT set, not writing '%s'\n",header->filename);
+                v->op.write_data = false;
+            }
+            #endif
+#ifdef UTFS_ENABLE_MAPPED
+            // A mapped file on the medium is never written, only its
+            // header when the padding after it changes
+            if((f->flags&UTFS_MAPPED)!=0 && f->offset!=0)
+            {
+                write_header = (f->gap_stored!=v->op.gap);
+                v->op.write_data = false;
+            }
+#endif
+            
+            // Write header
+            if(write_header)
+            {
+                _utfs_log("Writing file %d at pos %d\n",v->op.index,v->op.pos);
+                if(_save_write(v,v->op.pos,header,sizeof(utfs_header_t))!=RES_OK)
+                {
+                    _utfs_log("Error writing header, fs full\n");
+                    return _op_end(v,RES_FILESYSTEM_FULL);
+                }
+                used += sizeof(utfs_header_t);
+            }
+            v->op.pos += sizeof(utfs_header_t);
+            _file_resolved(f,v->op.pos-v->baseaddr,header->size,header->signature,header->flags,v->op.gap);
+
+            // Changes made from here on are picked up by the next save
+            if(v->op.write_data) _file_clean(f);
+            v->op.done = 0;
+            v->op.phase = UTFS_PHASE_DATA;
+            break;
+
+        case UTFS_PHASE_DATA:
+            f = v->file_list[v->op.index];
+            if(v->op.write_data && v->op.done<f->size)
+            {
+                n = f->size-v->op.done;
+                if(budget>0 && n>budget-used) n = budget-used;
+                if(_save_write(v,v->op.pos+v->op.done,(uint8_t*)(f->data)+v->op.done,n)!=RES_OK)
+                {
+                    _utfs_log("Error saving %s\n",f->filename);
+                    f->state |= UTFS_STATE_DIRTY;
+                    return _op_end(v,RES_FILESYSTEM_FULL);
+                }
+                v->op.done += n;
+                used += n;
+                if(v->op.done<f->size) break;
+            }
+
+            // Increment by size, and the padding up to the next header
+            v->op.pos += f->size+v->op.gap;
+            v->op.index++;
+            v->op.phase = UTFS_PHASE_HEADER;
+            break;
+
+        default:
+            if(_batch_flush(v,&(v->op.batch))!=RES_OK)
+            {
+                _utfs_log("Error writing batch, fs full\n");
+                return _op_end(v,RES_FILESYSTEM_FULL);
+            }
+            return _op_end(v,RES_OK);
+        }
+    }
+step_done:
+    // Put this step's writes on the medium before returning
+    if(_batch_flush(v,&(v->op.batch))!=RES_OK)
+    {
+        _utfs_log("Error writing batch, fs full\n");
+        return _op_end(v,RES_FILESYSTEM_FULL);
+    }
+    v->op.h = 0;
+    return RES_BUSY;
+}
+
+// Take in the header of the file at _op.pos, find the registered file and
+// set up the read of its data
+static void _load_parse(utfs_volume_t * v, utfs_header_t * header)
+{
+    utfs_file_t * f;
+
+    if(v->verbose) _print_header(header);
+    v->op.pos += sizeof(utfs_header_t);
+    v->op.next = v->op.pos+header->size+header->reserved;
+    v->op.done = 0;
+    v->op.size = 0;
+
+    // Find the file
+    f = _file_find(v,header->filename,_filename_hash(header->filename));
+    v->op.f = f;
+    if(f!=NULL && f->offset==0) v->op.unresolved--;
+    
+    // Handle data
+    if(f!=NULL) _file_resolved(f,v->op.pos-v->baseaddr,header->size,header->signature,header->flags,header->reserved);
+    if(f==NULL)
+    {
+        _utfs_log("Did not find file %s\n",header->filename);
+        v->op.unmatched++;
+
+#ifdef UTFS_ENABLE_MAPPED
+    }else if((f->flags&UTFS_MAPPED)!=0){
+        _file_map(v,f);
+        v->op.f = NULL;
+        v->op.loaded++;
+#endif
+
+    }else if(f->data==NULL){
+        _utfs_log("Null data, skipping\n");            
+        f->size_loaded=0;
+        f->signature=header->signature;
+        f->flags&=(0xFF00); // blank the lower byte
+        f->flags|=header->flags; // Add in the lower byte flags from the header
+        v->op.f = NULL;
+        v->op.loaded++;
+
+    #ifdef UTFS_ENABLE_FLAGS
+    }else if((f->flags&UTFS_LOAD_EXPLICIT)!=0){
+        _utfs_log("LOAD_EXPLICIT set, skipping read '%s'\n",header->filename);
+        f->size_loaded=0;
+        f->signature=0;
+        f->flags&=(0xFF00); // blank the lower byte
+        v->op.f = NULL;
+    #endif
+    }else{
+        // The file is saved with a size, but if this application
+        // has a smaller buffer, only read in that much
+        v->op.size = header->size;
+        if(v->op.size>f->size) v->op.size=f->size;
+        f->size_loaded=v->op.size;
+        f->signature=header->signature;
+        f->flags&=(0xFF00); // blank the lower byte
+        f->flags|=header->flags; // Add in the lower byte flags from the header
+    }
+}
+
+// Read for a load. With a scratch buffer the medium is read a buffer at a
+// time and headers and data are copied out of it; reads that would not fit
+// in the buffer go straight to the medium.
+static uint32_t _load_read(utfs_volume_t * v, uint32_t address, void * ptr, uint32_t length)
+{
+    uint8_t * data;
+    uint32_t done,n;
+
+    data = (uint8_t*)ptr;
+    done = 0;
+    while(done<length)
+    {
+        if(address>=v->scratch_addr && address<v->scratch_addr+v->scratch_len)
+        {
+            n = (v->scratch_addr+v->scratch_len)-address;
+            if(n>length-done) n=length-done;
+            memcpy(&(data[done]),&(v->scratch[address-v->scratch_addr]),n);
+            done += n;
+            address += n;
+        }else if(length-done>=v->scratch_size){
+            return done+_medium_read(v,address,&(data[done]),length-done);
+        }else{
+            v->scratch_addr = address;
+            v->scratch_len = _medium_read(v,address,v->scratch,v->scratch_size);
+            if(v->scratch_len==0) break;
+        }
+    }
+    return done;
+}
+
+// Write for the running save, into the batch or as a transfer of its own
+static utfs_result_e _save_write(utfs_volume_t * v, uint32_t address, void * ptr, uint32_t length)
+{
+#ifdef UTFS_ENABLE_ASYNC
+    if(v->op.async) return (length==0) ? RES_OK : _io_submit(v,UTFS_IO_WRITE,address,ptr,length);
+#endif
+    return _batch_write(v,&(v->op.batch),address,ptr,length);
+}
+
+#ifdef UTFS_ENABLE_ASYNC
+// The default volume's port, its transfers end with utfs_io_done()
+static bool _sys_write_async(utfs_volume_t * v, uint32_t address, void * ptr, uint32_t length)
+{
+    return sys_write_async(address,ptr,length);
+}
+
+static bool _sys_read_async(utfs_volume_t * v, uint32_t address, void * ptr, uint32_t length)
+{
+    return sys_read_async(address,ptr,length);
+}
+
+// Start a transfer for the running step operation, utfs_io_done() ends it
+static utfs_result_e _io_submit(utfs_volume_t * v, uint8_t io, uint32_t address, void * ptr, uint32_t length)
+{
+    bool started;
+    uint32_t n;
+
+    // Pending first, the port may finish before returning
+    v->op.io = io;
+    v->op.io_length = length;
+    v->io_length = 0;
+    v->io_pending = true;
+
+    // Reads stop at the end of the volume, writes must not cross it
+    n = _region_clip(v,address,length);
+    if(io==UTFS_IO_WRITE)
+    {
+        _snap_touch(v,address,length);
+        started = (n==length && v->port->write_async(v,address,ptr,length));
+    }
+    else if(n==0)
+    {
+        // Like a read past the end of the medium
+        v->io_pending = false;
+        return RES_OK;
+    }
+    else started = v->port->read_async(v,address,ptr,n);
+    if(started) return RES_OK;
+    v->io_pending = false;
+    v->op.io = UTFS_IO_NONE;
+    return (io==UTFS_IO_WRITE) ? RES_WRITE_ERROR : RES_READ_ERROR;
+}
+
+// A load transfer has finished, a short data read fails the load like
+// _file_read() does
+static utfs_result_e _load_done(utfs_volume_t * v)
+{
+    uint8_t io = v->op.io;
+
+    v->op.io = UTFS_IO_NONE;
+    if(io==UTFS_IO_HEADER)
+    {
+        v->op.valid = (v->io_length==sizeof(utfs_header_t) && _header_valid(&(v->op.ahead)));
+        return RES_OK;
+    }
+    if(v->io_length!=v->op.io_length)
+    {
+        _utfs_log("Error loading %s\n",v->op.reading->filename);
+        return RES_READ_ERROR;
+    }
+    _file_clean(v->op.reading);
+    v->op.loaded++;
+    return RES_OK;
+}
+
+// Load with one transfer running at a time. The header after each file is
+// read ahead of its data, and parsed while the data comes in.
+static utfs_result_e _load_async(utfs_volume_t * v)
+{
+    utfs_result_e res;
+
+    while(1)
+    {
+        if(v->op.io!=UTFS_IO_NONE)
+        {
+            if(!v->io_pending)
+            {
+                res = _load_done(v);
+                if(res!=RES_OK) return _op_end(v,res);
+            }
+            else if(v->op.io!=UTFS_IO_DATA || v->op.phase!=UTFS_PHASE_HEADER) return RES_BUSY;
+        }
+        switch(v->op.phase)
+        {
+        case UTFS_PHASE_START:
+            // Forget where files were, the medium may have changed
+            _file_forget(v);
+            v->op.unresolved = v->file_count;
+
+#ifdef UTFS_ENABLE_DIRECTORY
+            // Step over the directory, the headers after it carry the names
+            v->dir_checked=false;
+            if(_dir_check(v)==RES_OK) v->op.pos += _dir_size(v);
+#endif
+            v->op.phase = UTFS_PHASE_HEADER;
+            if(v->file_capacity==0) break;
+            res = _io_submit(v,UTFS_IO_HEADER,v->op.pos,&(v->op.ahead),sizeof(utfs_header_t));
+            if(res!=RES_OK) return _op_end(v,res);
+            break;
+
+        case UTFS_PHASE_HEADER:
+            // The header read ahead is in
+            if(!v->op.valid)
+            {
+                v->op.phase = UTFS_PHASE_END;
+                break;
+            }
+            memcpy(&(v->op.header),&(v->op.ahead),sizeof(utfs_header_t));
+            v->op.valid = false;
+            _load_parse(v,&(v->op.header));
+            v->op.index++;
+            v->op.phase = UTFS_PHASE_NEXT;
+            break;
+
+        case UTFS_PHASE_NEXT:
+            // Read as many headers as the table can hold, until every
+            // registered file has turned up
+            v->op.phase = UTFS_PHASE_DATA;
+            if(v->op.index==v->file_capacity || v->op.unresolved==0) break;
+            res = _io_submit(v,UTFS_IO_HEADER,v->op.next,&(v->op.ahead),sizeof(utfs_header_t));
+            if(res!=RES_OK) return _op_end(v,res);
+            break;
+
+        case UTFS_PHASE_DATA:
+            v->op.phase = UTFS_PHASE_HEADER;
+            if(v->op.f!=NULL && v->op.size>0)
+            {
+                v->op.reading = v->op.f;
+                res = _io_submit(v,UTFS_IO_DATA,v->op.pos,v->op.f->data,v->op.size);
+                if(res!=RES_OK) return _op_end(v,res);
+            }else if(v->op.f!=NULL){
+                _file_clean(v->op.f);
+                v->op.loaded++;
+            }
+            v->op.pos = v->op.next;
+            break;
+
+        default:
+            v->load_unmatched = v->op.unmatched;
+            v->load_missing = v->op.unresolved;
+
+            // If we didn't load anything
+            if(v->op.index==0)
+            {
+                _utfs_log("Error loading FS\n");
+                return _op_end(v,RES_INVALID_FS);
+            }
+            return _op_end(v,RES_OK);
+        }
+    }
+}
+#endif
+
+#ifdef UTFS_ENABLE_LOG_VOLUME
+static uint32_t _log_start(utfs_volume_t * v, uint32_t half)
+{
+    return v->baseaddr+(half*UTFS_LOG_HALF);
+}
+
+static bool _log_is_marker(utfs_header_t * header)
+{
+    return (header->identifier==UTFS_IDENTIFIER && header->version==UTFS_VERSION_LOG &&
+            header->filename[0]==0 && header->size==0);
+}
+
+// 16 bit check of a record's data, kept in the header's reserved field
+static uint16_t _log_check(uint32_t hash)
+{
+    return (uint16_t)(hash^(hash>>16));
+}
+
+// Find the newest half of the log. With no log on the medium the epoch is
+// left at 0, and the first save starts one.
+static utfs_result_e _log_find(utfs_volume_t * v)
+{
+    utfs_header_t marker[2];
+    bool found[2];
+    uint32_t h;
+
+    v->log_mounted = true;
+    v->log_compact = UTFS_COMPACT_IDLE;
+    for(h=0;h<2;h++)
+    {
+        found[h] = (_medium_read(v,_log_start(v,h),&(marker[h]),sizeof(utfs_header_t))==sizeof(utfs_header_t) &&
+                    _log_is_marker(&(marker[h])));
+    }
+    if(!found[0] && !found[1])
+    {
+        _utfs_log("No log on the medium\n");
+        _file_forget(v);
+        v->log_half = 0;
+        v->log_epoch = 0;
+        v->log_tail = _log_start(v,0)+sizeof(utfs_header_t);
+        return RES_INVALID_FS;
+    }
+
+    // Both halves are marked after a compaction, the newer one is live
+    if(found[0] && found[1]) h = ((int16_t)(marker[1].signature-marker[0].signature)>0) ? 1 : 0;
+    else h = found[1] ? 1 : 0;
+    v->log_half = h;
+    v->log_epoch = marker[h].signature;
+    _utfs_log("Log in half %d, epoch %d\n",v->log_half,v->log_epoch);
+    return RES_OK;
+}
+
+// Find the newest half of the log and scan it
+static utfs_result_e _log_mount(utfs_volume_t * v)
+{
+    if(_log_find(v)!=RES_OK) return RES_INVALID_FS;
+    _log_scan(v,_log_start(v,v->log_half)+sizeof(utfs_header_t),_log_start(v,v->log_half)+UTFS_LOG_HALF);
+    return RES_OK;
+}
+
+// Walk the records from 'start', the last record of each name wins
+static void _log_scan(utfs_volume_t * v, uint32_t start, uint32_t end)
+{
+    utfs_log_scan_t s;
+    uint32_t used;
+
+    used = 0;
+    _log_scan_begin(v,&s,start,end);
+    _log_scan_run(v,&s,0,&used);
+    return;
+}
+
+static void _log_scan_begin(utfs_volume_t * v, utfs_log_scan_t * s, uint32_t start, uint32_t end)
+{
+    // The headers are read through the scratch buffer, if there is one
+    v->scratch_len = 0;
+    _file_forget(v);
+    v->load_unmatched = 0;
+    memset(s,0,sizeof(utfs_log_scan_t));
+    s->start = start;
+    s->end = end;
+    s->pos = start;
+    s->hash = UTFS_FNV_OFFSET;
+    return;
+}
+
+// Go on with a walk until 'budget' bytes have been read (0 for no limit),
+// adding them to 'used'. Returns RES_BUSY if there is more to do. Only the
+// last record can have been cut short by a reset in the middle of a save,
+// its data is checked once the walk ends. If it is torn the walk starts
+// again, with the log ending before it.
+static utfs_result_e _log_scan_run(utfs_volume_t * v, utfs_log_scan_t * s, uint32_t budget, uint32_t * used)
+{
+    uint8_t chunk[UTFS_LOG_CHUNK];
+    utfs_header_t header;
+    utfs_file_t * f;
+    uint32_t n;
+
+    while(budget==0 || *used<budget)
+    {
+        if(s->checking)
+        {
+            if(s->done<s->size)
+            {
+                n = s->size-s->done;
+                if(n>sizeof(chunk)) n=sizeof(chunk);
+                *used += n;
+                if(_load_read(v,s->last+sizeof(header)+s->done,chunk,n)==n)
+                {
+                    s->hash = _data_hash(s->hash,chunk,n);
+                    s->done += n;
+                    continue;
+                }
+            }else if(_log_check(s->hash)==s->check){
+                v->log_tail = s->pos;
+                return RES_OK;
+            }
+            _utfs_log("Dropping torn record at %d\n",s->last);
+            _log_scan_begin(v,s,s->start,s->last);
+            continue;
+        }
+
+        *used += sizeof(header);
+        if(s->pos+sizeof(header)>s->end ||
+           _load_read(v,s->pos,&header,sizeof(header))!=sizeof(header) ||
+           header.identifier!=UTFS_IDENTIFIER || header.version!=UTFS_VERSION_LOG ||
+           _log_is_marker(&header) || header.size>s->end-(s->pos+sizeof(header)))
+        {
+            // Past the last record
+            if(s->last==0)
+            {
+                v->log_tail = s->pos;
+                return RES_OK;
+            }
+            s->checking = true;
+            continue;
+        }
+        if(v->verbose) _print_header(&header);
+        f = _file_find(v,header.filename,_filename_hash(header.filename));
+        if(f) _file_resolved(f,(s->pos+sizeof(header))-v->baseaddr,header.size,header.signature,header.flags,0);
+        else v->load_unmatched++;
+        s->last = s->pos;
+        s->size = header.size;
+        s->check = header.reserved;
+        s->pos += sizeof(header)+header.size;
+    }
+    return RES_BUSY;
+}
+
+static utfs_result_e _log_marker(utfs_volume_t * v, uint32_t half, uint16_t epoch)
+{
+    utfs_header_t header;
+
+    memset(&header,0,sizeof(header));
+    header.identifier = UTFS_IDENTIFIER;
+    header.version = UTFS_VERSION_LOG;
+    header.signature = epoch;
+    if(_write(v,_log_start(v,half),&header,sizeof(header))!=sizeof(header)) return RES_WRITE_ERROR;
+    return RES_OK;
+}
+
+// Scan the log and load the registered files, until 'budget' bytes have
+// been read (0 for no limit). Returns RES_BUSY if there is more to do.
+static utfs_result_e _log_load_run(utfs_volume_t * v, uint32_t budget)
+{
+    utfs_file_t * f;
+    uint32_t used,n;
+
+    used = 0;
+    while(budget==0 || used<budget)
+    {
+        switch(v->op.phase)
+        {
+        case UTFS_PHASE_START:
+            used += 2*sizeof(utfs_header_t);
+            if(_log_find(v)!=RES_OK) return _op_end(v,RES_INVALID_FS);
+            _log_scan_begin(v,&(v->op.scan),_log_start(v,v->log_half)+sizeof(utfs_header_t),_log_start(v,v->log_half)+UTFS_LOG_HALF);
+            v->op.phase = UTFS_PHASE_SCAN;
+            break;
+
+        case UTFS_PHASE_SCAN:
+            if(_log_scan_run(v,&(v->op.scan),budget,&used)!=RES_OK) return RES_BUSY;
+            v->load_missing = 0;
+            v->op.phase = UTFS_PHASE_HEADER;
+            break;
+
+        case UTFS_PHASE_HEADER:
+            // The scan has found where each registered file is
+            if(v->op.index==v->file_count)
+            {
+                v->op.phase = UTFS_PHASE_END;
+                break;
+            }
+            f = v->file_list[v->op.index];
+            v->op.f = NULL;
+            v->op.done = 0;
+            v->op.phase = UTFS_PHASE_DATA;
+            if(f->offset==0)
+            {
+                v->load_missing++;
+                break;
+            }
+            #ifdef UTFS_ENABLE_FLAGS
+            if((f->flags&UTFS_LOAD_EXPLICIT)!=0)
+            {
+                _utfs_log("LOAD_EXPLICIT set, skipping read '%s'\n",f->filename);
+                f->size_loaded=0;
+                f->signature=0;
+                f->flags&=(0xFF00); // blank the lower byte
+                break;
+            }
+            #endif
+            if(f->data==NULL)
+            {
+                _utfs_log("Null data, skipping\n");
+                v->op.loaded++;
+                break;
+            }
+            v->op.f = f;
+
+            // The file is saved with a size, but if this application
+            // has a smaller buffer, only read in that much
+            v->op.size = f->size_stored;
+            if(v->op.size>f->size) v->op.size=f->size;
+            break;
+
+        case UTFS_PHASE_DATA:
+            f = v->op.f;
+            if(f)
+            {
+                n = v->op.size-v->op.done;
+                if(budget>0 && n>budget-used) n = budget-used;
+                if(_medium_read(v,v->baseaddr+f->offset+v->op.done,(uint8_t*)(f->data)+v->op.done,n)!=n) return _op_end(v,RES_READ_ERROR);
+                v->op.done += n;
+                used += n;
+                if(v->op.done<v->op.size) break;
+                _file_loaded(f,v->op.size);
+                v->op.loaded++;
+            }
+            v->op.index++;
+            v->op.phase = UTFS_PHASE_HEADER;
+            break;
+
+        default:
+            return _op_end(v,RES_OK);
+        }
+    }
+    return RES_BUSY;
+}
+
+// Append a new version of the changed files, or only of 'only'
+static utfs_result_e _log_save(utfs_volume_t * v, bool flush, utfs_file_t * only)
+{
+    if(_op_begin(v,UTFS_OP_SAVE,flush,false)!=RES_OK) return RES_BUSY;
+    v->op.only = only;
+    return _log_save_run(v,0);
+}
+
+// Append records until 'budget' bytes have been written (0 for no limit).
+// Returns RES_BUSY if there is more to do. A record that fits in the step
+// is written in one go. A bigger one has its data written first, a piece
+// at a time, and its header last with the check of what was written; a
+// reset in between leaves no header, and the log ends before the record.
+static utfs_result_e _log_save_run(utfs_volume_t * v, uint32_t budget)
+{
+    utfs_file_t * f;
+    utfs_header_t * header;
+    uint32_t used,n;
+    bool write;
+
+    used = 0;
+    while(budget==0 || used<budget)
+    {
+        switch(v->op.phase)
+        {
+        case UTFS_PHASE_START:
+            // Mount the log first, unless a load or save already has
+            v->op.phase = UTFS_PHASE_SCAN;
+            if(v->log_mounted) break;
+            used += 2*sizeof(utfs_header_t);
+            if(_log_find(v)==RES_OK) _log_scan_begin(v,&(v->op.scan),_log_start(v,v->log_half)+sizeof(utfs_header_t),_log_start(v,v->log_half)+UTFS_LOG_HALF);
+            break;
+
+        case UTFS_PHASE_SCAN:
+            if(v->op.scan.end!=0 && _log_scan_run(v,&(v->op.scan),budget,&used)!=RES_OK) return RES_BUSY;
+            if(v->log_epoch==0)
+            {
+                _utfs_log("Starting a log\n");
+                if(_log_marker(v,0,1)!=RES_OK) return _op_end(v,RES_FILESYSTEM_FULL);
+                v->log_epoch = 1;
+                used += sizeof(utfs_header_t);
+            }
+            v->op.phase = UTFS_PHASE_HEADER;
+            break;
+
+        case UTFS_PHASE_HEADER:
+            if(v->op.index==v->file_count)
+            {
+                v->op.phase = UTFS_PHASE_END;
+                break;
+            }
+            f = v->file_list[v->op.index];
+            write = (!v->op.only || f==v->op.only);
+#ifdef UTFS_ENABLE_INCREMENTAL
+            if(write && !v->op.flush && !v->op.only && f->offset!=0 && f->size_stored==f->size &&
+               f->signature_stored==f->signature && f->flags_stored==((f->flags)&0x00FF))
+            {
+                write = _file_changed(f);
+            }
+#endif
+            #ifdef UTFS_ENABLE_FLAGS
+            if(write && !v->op.flush && !v->op.only && (f->flags&UTFS_SAVE_EXPLICIT)!=0)
+            {
+                _utfs_log("SAVE_EXPLICIT set, not writing '%s'\n",f->filename);
+                write = false;
+            }
+            #endif
+            if(!write)
+            {
+                v->op.index++;
+                break;
+            }
+
+            if(v->log_tail+sizeof(utfs_header_t)+f->size>_log_start(v,v->log_half)+UTFS_LOG_HALF)
+            {
+                // Out of room, move the live files over to the other half
+                // now, a compaction step at a time
+                if(v->log_compact==UTFS_COMPACT_IDLE)
+                {
+                    if(v->op.compacted)
+                    {
+                        _utfs_log("Error saving %s, log full\n",f->filename);
+                        return _op_end(v,RES_FILESYSTEM_FULL);
+                    }
+                    _log_compact_begin(v);
+                }
+                v->op.compacted = true;
+                if(_log_step(v)!=RES_OK)
+                {
+                    _utfs_log("Error saving %s, log full\n",f->filename);
+                    return _op_end(v,RES_FILESYSTEM_FULL);
+                }
+                used += UTFS_LOG_STEP;
+                break;
+            }
+
+            header = &(v->op.header);
+            _header_fill(header,f,0);
+            header->version = UTFS_VERSION_LOG;
+            _utfs_log("Appending %s at %d\n",f->filename,v->log_tail);
+
+            // Changes made from here on are picked up by the next save
+            _file_clean(f);
+            v->op.f = f;
+            v->op.done = 0;
+            v->op.hash = UTFS_FNV_OFFSET;
+            v->op.phase = UTFS_PHASE_DATA;
+            break;
+
+        case UTFS_PHASE_DATA:
+            f = v->op.f;
+            header = &(v->op.header);
+            n = f->size-v->op.done;
+            if(v->op.done==0 && (budget==0 || sizeof(utfs_header_t)+n<=budget-used))
+            {
+                header->reserved = _log_check(_data_hash(UTFS_FNV_OFFSET,f->data,f->size));
+                if(_batch_write(v,&(v->op.batch),v->log_tail,header,sizeof(utfs_header_t))!=RES_OK ||
+                   _batch_write(v,&(v->op.batch),v->log_tail+sizeof(utfs_header_t),f->data,f->size)!=RES_OK ||
+                   _batch_flush(v,&(v->op.batch))!=RES_OK)
+                {
+                    _utfs_log("Error saving %s, log full\n",f->filename);
+                    return _op_end(v,RES_FILESYSTEM_FULL);
+                }
+                used += sizeof(utfs_header_t)+n;
+            }else if(n>0){
+                if(budget>0 && n>budget-used) n = budget-used;
+                v->op.hash = _data_hash(v->op.hash,(uint8_t*)(f->data)+v->op.done,n);
+                if(_write(v,v->log_tail+sizeof(utfs_header_t)+v->op.done,(uint8_t*)(f->data)+v->op.done,n)!=n)
+                {
+                    _utfs_log("Error saving %s, log full\n",f->filename);
+                    return _op_end(v,RES_FILESYSTEM_FULL);
+                }
+                v->op.done += n;
+                used += n;
+                break;
+            }else{
+                header->reserved = _log_check(v->op.hash);
+                if(_write(v,v->log_tail,header,sizeof(utfs_header_t))!=sizeof(utfs_header_t))
+                {
+                    _utfs_log("Error saving %s, log full\n",f->filename);
+                    return _op_end(v,RES_FILESYSTEM_FULL);
+                }
+                used += sizeof(utfs_header_t);
+            }
+            _file_resolved(f,(v->log_tail+sizeof(utfs_header_t))-v->baseaddr,header->size,header->signature,header->flags,0);
+            f->state &= ~UTFS_STATE_COPIED;
+            v->log_tail += sizeof(utfs_header_t)+f->size;
+            v->log_restarted = false;
+
+            // Start making room before it runs out
+            if(v->log_compact==UTFS_COMPACT_IDLE &&
+               (v->log_tail-_log_start(v,v->log_half))>=(uint64_t)UTFS_LOG_HALF*UTFS_LOG_COMPACT_AT/100) _log_compact_begin(v);
+            v->op.compacted = false;
+            v->op.index++;
+            v->op.phase = UTFS_PHASE_HEADER;
+            break;
+
+        default:
+            return _op_end(v,RES_OK);
+        }
+    }
+    return RES_BUSY;
+}
+
+static void _log_compact_begin(utfs_volume_t * v)
+{
+    uint32_t x;
+
+    _utfs_log("Compaction started\n");
+    v->log_compact = UTFS_COMPACT_ERASE;
+    v->log_restarted = false;
+    v->log_compact_pos = _log_start(v,1-v->log_half);
+    for(x=0;x<v->file_count;x++) v->file_list[x]->state &= ~UTFS_STATE_COPIED;
+    return;
+}
+
+// One bounded step of compaction: erase up to UTFS_LOG_STEP bytes of the
+// other half, or copy the newest record of one file into it. Once every
+// file is copied the other half is marked with the next epoch, which
+// makes it the live half.
+static utfs_result_e _log_step(utfs_volume_t * v)
+{
+    uint8_t chunk[UTFS_LOG_CHUNK];
+    utfs_header_t header;
+    utfs_file_t * f;
+    uint32_t other,start,end,done,n,x;
+
+    other = 1-v->log_half;
+    start = _log_start(v,other);
+    end = start+UTFS_LOG_HALF;
+
+    if(v->log_compact==UTFS_COMPACT_ERASE)
+    {
+        memset(chunk,0xFF,sizeof(chunk));
+        for(done=0;done<UTFS_LOG_STEP && v->log_compact_pos<end;done+=n)
+        {
+            n = end-v->log_compact_pos;
+            if(n>sizeof(chunk)) n=sizeof(chunk);
+            if(_write(v,v->log_compact_pos,chunk,n)!=n) return RES_WRITE_ERROR;
+            v->log_compact_pos += n;
+        }
+        if(v->log_compact_pos==end)
+        {
+            v->log_compact = UTFS_COMPACT_COPY;
+            v->log_compact_pos = start+sizeof(utfs_header_t);
+        }
+        return RES_OK;
+    }
+    if(v->log_compact!=UTFS_COMPACT_COPY) return RES_OK;
+
+    // Next file still to copy, saves since it was copied clear the bit
+    f = NULL;
+    for(x=0;x<v->file_count && !f;x++)
+    {
+        if(v->file_list[x]->offset!=0 && (v->file_list[x]->state&UTFS_STATE_COPIED)==0) f = v->file_list[x];
+    }
+    if(f)
+    {
+        if(_medium_read(v,v->baseaddr+f->offset-sizeof(header),&header,sizeof(header))!=sizeof(header)) return RES_READ_ERROR;
+        if(v->log_compact_pos+sizeof(header)+header.size>end)
+        {
+            // Copies made before a file was saved again take up room, erase
+            // and start over without them. With no save since the last
+            // start there is nothing to gain.
+            if(v->log_restarted) return RES_FILESYSTEM_FULL;
+            _utfs_log("Compaction ran out of room, starting again\n");
+            _log_compact_begin(v);
+            v->log_restarted = true;
+            return RES_OK;
+        }
+        _utfs_log("Compaction copying %s\n",f->filename);
+        if(_write(v,v->log_compact_pos,&header,sizeof(header))!=sizeof(header)) return RES_WRITE_ERROR;
+        v->log_compact_pos += sizeof(header);
+        for(done=0;done<header.size;done+=n)
+        {
+            n = header.size-done;
+            if(n>sizeof(chunk)) n=sizeof(chunk);
+            if(_medium_read(v,v->baseaddr+f->offset+done,chunk,n)!=n) return RES_READ_ERROR;
+            if(_write(v,v->log_compact_pos,chunk,n)!=n) return RES_WRITE_ERROR;
+            v->log_compact_pos += n;
+        }
+        f->state |= UTFS_STATE_COPIED;
+        return RES_OK;
+    }
+
+    // Everything is copied, switch halves
+    v->log_epoch++;
+    if(v->log_epoch==0) v->log_epoch = 1;
+    if(_log_marker(v,other,v->log_epoch)!=RES_OK) return RES_WRITE_ERROR;
+    _utfs_log("Compaction done, epoch %d\n",v->log_epoch);
+    v->log_half = other;
+    v->log_compact = UTFS_COMPACT_IDLE;
+    _log_scan(v,start+sizeof(utfs_header_t),end);
+    return RES_OK;
+}
+#endif
+
+#ifdef UTFS_ENABLE_DIRECTORY
+static uint32_t _dir_size(utfs_volume_t * v)
+{
+    return sizeof(utfs_dir_header_t)+(v->dir_count*sizeof(utfs_dir_entry_t))+v->dir_pad;
+}
+
+// Write the directory header for the running save, and set up the writes
+// of its entries with _dir_chunk()
+static utfs_result_e _dir_begin(utfs_volume_t * v)
+{
+    utfs_dir_header_t dir;
+    bool changed;
+
+    if(v->file_count>0xFFFF) return RES_FILESYSTEM_FULL;
+
+    // The whole directory is written unless the one on the medium has
+    // the same number of entries
+    changed = (v->op.flush || !v->dir_checked || !v->dir_present || v->dir_count!=v->file_count);
+#ifndef UTFS_ENABLE_INCREMENTAL
+    changed = true;
+#endif
+
+    v->dir_checked = true;
+    v->dir_present = true;
+    v->dir_count = v->file_count;
+    v->dir_pad = 0;
+    v->dir_pad = _align_gap(v->baseaddr+_dir_size(v));
+
+    memset(&dir,0,sizeof(dir));
+    dir.identifier = UTFS_IDENTIFIER;
+    dir.version = UTFS_VERSION_V2;
+    dir.count = v->file_count;
+    dir.size = _dir_size(v);
+
+    if(changed && _write(v,v->baseaddr,&dir,sizeof(dir))!=sizeof(dir)) return RES_FILESYSTEM_FULL;
+    v->op.dir_entry = 0;
+    v->op.dir_offset = dir.size;
+    v->op.dir_changed = changed;
+    return RES_OK;
+}
+
+// Write the next UTFS_DIR_CHUNK entries, in the same order as the files.
+// A chunk where no file moved or changed its header is skipped.
+static utfs_result_e _dir_chunk(utfs_volume_t * v, uint32_t * written)
+{
+    utfs_dir_entry_t entries[UTFS_DIR_CHUNK];
+    utfs_file_t * f;
+    uint32_t x,n;
+    uint32_t pos;
+    bool changed;
+
+    *written = 0;
+    changed = v->op.dir_changed;
+    x = v->op.dir_entry;
+    pos = v->baseaddr+sizeof(utfs_dir_header_t)+(x*sizeof(utfs_dir_entry_t));
+    for(n=0;n<UTFS_DIR_CHUNK && x<v->file_count;n++,x++)
+    {
+        f = v->file_list[x];
+        v->op.dir_offset += sizeof(utfs_header_t);
+        memset(&(entries[n]),0,sizeof(utfs_dir_entry_t));
+        entries[n].hash = f->hash;
+        entries[n].offset = v->op.dir_offset;
+        entries[n].size = f->size;
+        entries[n].signature = f->signature;
+        entries[n].flags = ((f->flags)&0x00FF);
+        if(f->offset!=v->op.dir_offset || f->size_stored!=f->size ||
+           f->signature_stored!=entries[n].signature || f->flags_stored!=entries[n].flags) changed = true;
+        v->op.dir_offset += f->size+_file_gap(v,f,v->op.dir_offset);
+    }
+    v->op.dir_entry = x;
+#ifdef UTFS_ENABLE_INCREMENTAL
+    v->op.dir_changed = v->op.flush;
+#endif
+    if(!changed) return RES_OK;
+    if(_write(v,pos,entries,n*sizeof(utfs_dir_entry_t))!=n*sizeof(utfs_dir_entry_t)) return RES_FILESYSTEM_FULL;
+    *written = n*sizeof(utfs_dir_entry_t);
+    return RES_OK;
+}
+
+// Learn whether the medium starts with a directory, once. That updates
+// the volume, so the first call needs it held exclusively; with it shared
+// the answer is only read, see _file_shared().
+static utfs_result_e _dir_check(utfs_volume_t * v)
+{
+    utfs_dir_header_t dir;
+
+    if(!v->dir_checked)
+    {
+        v->dir_checked = true;
+        v->dir_present = false;
+        if(_medium_read(v,v->baseaddr,&dir,sizeof(dir))==sizeof(dir) &&
+           dir.identifier==UTFS_IDENTIFIER && dir.version==UTFS_VERSION_V2 &&
+           dir.size>=sizeof(dir)+(dir.count*sizeof(utfs_dir_entry_t)))
+        {
+            _utfs_log("Directory, %d entries\n",dir.count);
+            v->dir_present = true;
+            v->dir_count = dir.count;
+            v->dir_pad = dir.size-(sizeof(dir)+(dir.count*sizeof(utfs_dir_entry_t)));
+        }
+    }
+    return v->dir_present ? RES_OK : RES_INVALID_FS;
+}
+
+// Find a file in the directory. Entries are written in registration order,
+// so try the file's own slot first and only scan if the medium differs.
+static utfs_result_e _dir_find(utfs_volume_t * v, utfs_file_t * f, utfs_dir_entry_t * entry, uint32_t * index)
+{
+    utfs_dir_entry_t entries[UTFS_DIR_CHUNK];
+    uint32_t x,n,i;
+    uint32_t pos;
+
+    if(_dir_check(v)!=RES_OK) return RES_INVALID_FS;
+
+    pos = v->baseaddr+sizeof(utfs_dir_header_t);
+
+    for(x=0;x<v->file_count;x++)
+    {
+        if(v->file_list[x]==f) break;
+    }
+    if(x<v->dir_count)
+    {
+        if(_medium_read(v,pos+(x*sizeof(utfs_dir_entry_t)),entry,sizeof(utfs_dir_entry_t))!=sizeof(utfs_dir_entry_t)) return RES_READ_ERROR;
+        if(entry->hash==f->hash)
+        {
+            if(index) *index = x;
+            return RES_OK;
+        }
+    }
+
+    for(x=0;x<v->dir_count;x+=n)
+    {
+        n = v->dir_count-x;
+        if(n>UTFS_DIR_CHUNK) n=UTFS_DIR_CHUNK;
+        if(_medium_read(v,pos+(x*sizeof(utfs_dir_entry_t)),entries,n*sizeof(utfs_dir_entry_t))!=n*sizeof(utfs_dir_entry_t)) return RES_READ_ERROR;
+        for(i=0;i<n;i++)
+        {
+            if(entries[i].hash==f->hash)
+            {
+                memcpy(entry,&(entries[i]),sizeof(utfs_dir_entry_t));
+                if(index) *index = x+i;
+                return RES_OK;
+            }
+        }
+    }
+    return RES_FILE_NOT_FOUND;
+}
+#endif
+
+// FNV-1a over the filename, up to the size of the header field
+static uint32_t _filename_hash(const char * name)
+{
+    uint32_t hash;
+    int x;
+    hash = UTFS_FNV_OFFSET;
+    for(x=0;x<UTFS_MAX_FILENAME+1 && name[x]!=0;x++)
+    {
+        hash ^= (uint8_t)name[x];
+        hash *= UTFS_FNV_PRIME;
+    }
+    return hash;
+}
+
+#if defined(UTFS_DATA_HASH) || defined(UTFS_ENABLE_LOG_VOLUME)
+// FNV-1a over the file data, to spot changes between saves. Continues
+// from 'hash', start with UTFS_FNV_OFFSET.
+static uint32_t _data_hash(uint32_t hash, void * data, uint32_t size)
+{
+    uint8_t * p;
+    if(!data) return hash;
+    for(p=(uint8_t*)data;size>0;size--,p++)
+    {
+        hash ^= *p;
+        hash *= UTFS_FNV_PRIME;
+    }
+    return hash;
+}
+#endif
+
+static utfs_file_t * _file_find(utfs_volume_t * v, const char * name, uint32_t hash)
+{
+    utfs_file_t * f;
+    for(f=v->hash_list[hash&v->hash_mask];f!=NULL;f=f->next)
+    {
+        if(f->hash==hash && strncmp(f->filename,name,UTFS_MAX_FILENAME+1)==0) return f;
+    }
+    return NULL;
+}
+
+static void _hash_insert(utfs_volume_t * v, utfs_file_t * f)
+{
+    uint32_t b;
+    b = f->hash&v->hash_mask;
+    f->next = v->hash_list[b];
+    v->hash_list[b] = f;
+    return;
+}
+
+static void _hash_remove(utfs_volume_t * v, utfs_file_t * f)
+{
+    utfs_file_t ** link;
+    for(link=&(v->hash_list[f->hash&v->hash_mask]);*link!=NULL;link=&((*link)->next))
+    {
+        if(*link==f){
+            *link = f->next;
+            f->next = NULL;
+            return;
+        }
+    }
+    return;
+}
+
 // EOF